@@ -10,637 +10,5411 @@
 // support multi-threaded programs.
 //
 
+// For mremap()
+
+#define _GNU_SOURCE
+
 #include "MyMalloc.h"
 
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
 
 
-// This mutex must be held whenever modifying internal allocator state,
-// or referencing state that is subject to change. The skeleton should
-// take care of this automatically, unless you make modifications to the
-// C interface (malloc(), calloc(), realloc(), and free()).
-
-static pthread_mutex_t mutex;
+// All allocator state lives in arenas (see struct arena below). The mutex of
+// an arena must be held whenever modifying its state, or referencing state
+// that is subject to change. The C interface (malloc(), calloc(), realloc(),
+// and free()) takes care of this.
 
 // The size of block to get from the OS (2MB).
 
 #define ARENA_SIZE ((size_t) 2097152)
 
+// Size of each chunk requested from the OS: the arena plus a fencepost at
+// either end and the header and footer of the free object between them.
+
+#define OS_CHUNK_SIZE (ARENA_SIZE + \
+                       (2 * sizeof(object_header)) + \
+                       (2 * sizeof(object_footer)))
+
+// OS chunks come from sbrk() by default. Build with
+// -DMYMALLOC_MMAP_ARENAS=1, or set MALLOCBACKEND=mmap in the environment, to
+// map each chunk with mmap() instead, so that the allocator does not depend on
+// owning the program break and entirely free chunks can always be unmapped.
+// With the mmap() backend, MALLOCHUGEPAGES=thp aligns chunks to
+// HUGE_PAGE_SIZE and asks for transparent huge pages, and
+// MALLOCHUGEPAGES=hugetlb maps them from the hugetlbfs pool (falling back to
+// normal pages if none are reserved).
+
+#ifndef MYMALLOC_MMAP_ARENAS
+#define MYMALLOC_MMAP_ARENAS (0)
+#endif
+
+#define HUGE_PAGE_SIZE ((size_t) 2097152)
+
+enum os_backend {
+  SBRK_BACKEND,
+  MMAP_BACKEND
+};
+
+enum huge_page_mode {
+  NO_HUGE_PAGES,
+  TRANSPARENT_HUGE_PAGES,
+  HUGETLB_PAGES
+};
+
+// Build with -DMYMALLOC_SLABS=1 to serve requests of up to SLAB_MAX_SIZE
+// bytes from slabs: runs of SLAB_RUN_SIZE bytes, aligned to their size, that
+// each hold objects of one size class with no header or footer. The run
+// owning an object is found by masking its address, and slab objects are
+// recognised by lying in the region reserved for runs at start-up.
+
+#ifndef MYMALLOC_SLABS
+#define MYMALLOC_SLABS (0)
+#endif
+
+#if MYMALLOC_SLABS
+#define SLAB_MAX_SIZE (128)
+#define SLAB_NUM_CLASSES (SLAB_MAX_SIZE / SIZE_PRECISION)
+#define SLAB_RUN_SIZE ((size_t) 65536)
+#define SLAB_REGION_SIZE ((size_t) 1 << ((sizeof(void *) == 8) ? 32 : 26))
+#endif
+
+// Free objects of at least this many bytes have their interior pages given
+// back with madvise(MADV_DONTNEED) once they have stayed free for a whole
+// trim interval. Set the MALLOCTRIMIDLE environment variable to the number of
+// frees between trim passes to enable this (see trim_heap()).
+
+#ifndef TRIM_SPAN_THRESHOLD
+#define TRIM_SPAN_THRESHOLD ((size_t) 65536)
+#endif
+
+// Requests larger than this many bytes get their own mapping from mmap()
+// and are returned to the OS by free(). The threshold can be lowered at run
+// time with the MALLOCMMAPTHRESHOLD environment variable (see initialize()),
+// but never raised above ARENA_SIZE, the most an OS chunk can hold.
+
+#ifndef MMAP_THRESHOLD
+#define MMAP_THRESHOLD ARENA_SIZE
+#endif
+
+// calloc() requests larger than this many bytes get a mapping of their own
+// even below the mmap threshold: its pages are zero already, so they need
+// not be cleared, nor even touched until the program writes them.
+
+#ifndef CALLOC_MMAP_THRESHOLD
+#define CALLOC_MMAP_THRESHOLD ((size_t) 131072)
+#endif
+
+// Per-thread caches of small blocks sit in front of the mutex (see
+// tcache_allocate()). Blocks sitting in a thread cache do not show up in
+// print_list(), so the test programs are built with -DMYMALLOC_THREAD_CACHE=0
+// (see TESTFLAGS in the Makefile).
+
+#ifndef MYMALLOC_THREAD_CACHE
+#define MYMALLOC_THREAD_CACHE (1)
+#endif
+
+// Build with -DMYMALLOC_REMOTE_FREES=1 to let free() push the object on a
+// lock-free stack of its arena instead of waiting when the arena's mutex is
+// busy. The next allocate_object() (or free() that gets the mutex) in that
+// arena drains the whole stack, so a thread freeing what another thread
+// allocates no longer fights it for the lock.
+
+#ifndef MYMALLOC_REMOTE_FREES
+#define MYMALLOC_REMOTE_FREES (0)
+#endif
+
+// The x86-64 ABI wants malloc() to return 16-byte aligned memory, so objects
+// are rounded to 16 bytes. print_list() output, and the test programs'
+// reference output with it, depends on 8-byte rounding, so the test
+// programs are built with -DMYMALLOC_ALIGN16=0 (see TESTFLAGS in the
+// Makefile). Compact headers always align to 16 bytes.
+
+#ifndef MYMALLOC_ALIGN16
+#define MYMALLOC_ALIGN16 (1)
+#endif
+
+// SIZE_PRECISION determines how to round, and is the alignment of every
+// object from the free lists.
+// By default, round up to nearest 16 bytes (see MYMALLOC_ALIGN16).
+// It must be a power of 2.
+// MINIMUM_SIZE is the minimum size that can be requested, not including
+// header and footer. Smaller requests are rounded up to this minimum.
+//
+// With compact headers (see MyMalloc.h) objects are rounded to 16 bytes,
+// which keeps usable memory 16-byte aligned behind the 8-byte header and
+// leaves four flag bits in object_size, and a free object must have room
+// for its links and footer.
+
+#if MYMALLOC_COMPACT_HEADERS
+#define SIZE_PRECISION (16)
+#define HEADER_SIZE (sizeof(size_t))
+#define MINIMUM_SIZE (sizeof(object_header) + sizeof(object_footer) - \
+                      HEADER_SIZE)
+#define OBJECT_OVERHEAD HEADER_SIZE
+#else
+#define SIZE_PRECISION (MYMALLOC_ALIGN16 ? 16 : 8)
+#define HEADER_SIZE (sizeof(object_header))
+#define MINIMUM_SIZE (8)
+#define OBJECT_OVERHEAD (sizeof(object_header) + sizeof(object_footer))
+#endif
+
+// The smallest object the free lists can hold, and the offset of the header
+// of a mapped object from the start of its mapping, which keeps its usable
+// memory 16-byte aligned
+
+#define MIN_OBJECT_SIZE (OBJECT_OVERHEAD + MINIMUM_SIZE)
+#define MAPPED_HEADER_OFFSET ((16 - (HEADER_SIZE % 16)) % 16)
+
+// Free objects are kept in segregated free lists: one bin per usable size up
+// to SMALL_BIN_MAX bytes, then one bin per power-of-two range. A bitmap of
+// non-empty bins finds the first bin that fits with a single bit-scan. Build
+// with -DMYMALLOC_SEGREGATED=0 for a single first-fit free list instead,
+// whose order the test programs' print_list() output depends on (see
+// TESTFLAGS in the Makefile).
+
+#ifndef MYMALLOC_SEGREGATED
+#define MYMALLOC_SEGREGATED (1)
+#endif
+
+// Freed objects are pushed onto the head of their free list in O(1).
+// Build with -DMYMALLOC_ADDRESS_ORDERED=1 to keep every free list sorted by
+// address instead, which makes print_list() output deterministic; the test
+// programs are built this way (see TESTFLAGS in the Makefile).
+
+#ifndef MYMALLOC_ADDRESS_ORDERED
+#define MYMALLOC_ADDRESS_ORDERED (0)
+#endif
+
+// How find_free_object() places a request, set with the MALLOCFIT
+// environment variable (see initialize()):
+//   first  the first free object that fits, in list order (the default)
+//   next   the same, resuming the search where the previous one stopped
+//   best   the smallest free object that fits. Free objects of at least
+//          SIZE_TREE_MIN bytes are also kept in a tree ordered by size and
+//          address, which finds them in O(log n); smaller requests scan
+//          their bin for the best fit and fall back to the next bin.
+
+#ifndef SIZE_TREE_MIN
+#define SIZE_TREE_MIN ((size_t) 1024)
+#endif
+
+enum fit_policy {
+  FIRST_FIT,
+  NEXT_FIT,
+  BEST_FIT
+};
+
+// Build with -DMYMALLOC_QUICK_LISTS=1 to defer coalescing: a freed object of
+// up to QUICK_MAX_SIZE bytes goes onto the quick list of its arena for its
+// exact size, keeping its ALLOCATED status, and is handed out again as is to
+// the next request of that size. Quick lists are merged into the free lists
+// in a batch when one grows past QUICK_LIST_MAX objects, when a search of
+// the free lists fails, and before malloc_trim() and print_list(). By
+// default every free() coalesces at once.
+
+#ifndef MYMALLOC_QUICK_LISTS
+#define MYMALLOC_QUICK_LISTS (0)
+#endif
+
+#define QUICK_MAX_SIZE ((size_t) 512)
+#define QUICK_LIST_MAX (64)
+#define NUM_QUICK_LISTS ((int) (QUICK_MAX_SIZE / SIZE_PRECISION) + 1)
+
+#if MYMALLOC_SEGREGATED
+#define SMALL_BIN_SHIFT (9)
+#define SMALL_BIN_MAX ((size_t) 1 << SMALL_BIN_SHIFT)
+#define NUM_SMALL_BINS ((int) (SMALL_BIN_MAX / SIZE_PRECISION))
+#define NUM_BINS (128)
+#define NUM_BITMAP_WORDS ((NUM_BINS + 63) / 64)
+#else
+#define NUM_BINS (1)
+#endif
+
+// Threads are spread over up to MAX_ARENAS arenas, each with its own mutex,
+// free lists, and OS chunks. The main arena gets its chunks from the
+// backend; every other arena carves them out of its own ARENA_SPAN bytes of
+// an address range reserved at start-up, which it grows and shrinks like a
+// private program break. The arena owning an object is thus known from its
+// address. Set MALLOCARENAS in the environment to the number of arenas (by
+// default, one per CPU), and MALLOCARENAPOLICY=cpu to pick a thread's arena
+// by the CPU it runs on rather than round-robin (see lock_arena()). Build
+// with -DMYMALLOC_ARENAS=0 for the main arena only; the test programs are
+// built this way (see TESTFLAGS in the Makefile), since the thread-local
+// arena pointer alone changes how much glibc allocates for each thread,
+// which shows in the output of the threaded test.
+
+#ifndef MYMALLOC_ARENAS
+#define MYMALLOC_ARENAS (1)
+#endif
+
+#if MYMALLOC_ARENAS
+#define MAX_ARENAS ((sizeof(void *) == 8) ? 64 : 8)
+#else
+#define MAX_ARENAS (1)
+#endif
+#define ARENA_SPAN ((size_t) 1 << ((sizeof(void *) == 8) ? 32 : 26))
+
+enum arena_policy {
+  ROUND_ROBIN_ARENAS,
+  CPU_ARENAS
+};
+
+// Build with -DMYMALLOC_DEBUG=1 to catch misuse of the heap: every block is
+// surrounded by DEBUG_REDZONE bytes of DEBUG_CANARY, preceded by a struct
+// debug_header, and filled with DEBUG_POISON once freed. free() and
+// realloc() abort on a double free, a pointer that never came from malloc(),
+// or a clobbered canary, and mymalloc_check_heap() runs at exit. Release
+// builds compile all of it out.
+
+#ifndef MYMALLOC_DEBUG
+#define MYMALLOC_DEBUG (0)
+#endif
+
+#define DEBUG_REDZONE ((size_t) 64)
+#define DEBUG_CANARY (0xfd)
+#define DEBUG_POISON (0xdd)
+#define DEBUG_LIVE ((size_t) 0x6d796d616c6c6f63)
+#define DEBUG_FREED ((size_t) 0x6672656564626c6b)
+
 
 // STATE VARIABLES
 
-// Sum total size of heap
+#if MYMALLOC_SLABS
 
-static size_t heap_size;
+// A slab run. The header is followed by the objects, all object_size bytes
+// long. Freed objects are chained through their first word; objects past
+// unused have never been handed out. Runs with free objects are kept on a
+// per-class list of their arena; full runs are on none (next is NULL).
 
-// Start of memory pool
+struct slab_run {
+  struct slab_run *next;
+  struct slab_run *prev;
+  struct arena *arena;
+  void *free_objects;
+  char *unused;
+  size_t object_size;
+  int num_allocated;
+};
 
-static void *mem_start;
+#define SLAB_RUN_HEADER_SIZE ((sizeof(struct slab_run) + 15) & ~(size_t) 15)
 
-// Number of chunks requested from OS so far
+// The region reserved for runs, shared by all arenas, and the part of it
+// handed out so far
 
-static int num_chunks;
+static char *slab_region;
+static char *slab_region_used;
 
-// Verbose mode enabled via environment variable
-// (See initialize())
+#endif // MYMALLOC_SLABS
 
-static int verbose;
+// An arena: an independent heap behind its own mutex
 
-// Keep track of the number of calls to each function
+struct arena {
+  pthread_mutex_t mutex;
 
-static int malloc_calls;
-static int free_calls;
-static int realloc_calls;
-static int calloc_calls;
+  // When the current holder of the mutex got it, in profiling mode
 
-// The free list is a doubly-linked list, with a constant sentinel.
+  uint64_t locked_at;
 
-static object_header free_list_sentinel;
-static object_header *free_list;
+  // The statistics shard the holder of the mutex looked up for its
+  // operation, where splits, coalesces and OS chunks are counted. Holders
+  // that look up none count in the shard of the previous one.
 
+  struct stat_shard *stat_shard;
 
-/*
- * Increments the number of calls to malloc().
- */
+  // The free lists are doubly-linked lists, each with a constant sentinel,
+  // one per bin.
 
-void increase_malloc_calls() {
-  malloc_calls++;
-} /* increase_malloc_calls() */
+  object_header free_list[NUM_BINS];
 
-/*
- * Increase the number of calls to realloc().
- */
+#if MYMALLOC_SEGREGATED
+  // One bit per bin, set while that bin's free list is not empty
 
-void increase_realloc_calls() {
-  realloc_calls++;
-} /* increase_realloc_calls() */
+  uint64_t bin_bitmap[NUM_BITMAP_WORDS];
+#endif
 
-/*
- * Increase the number of calls to calloc().
- */
+  // With best fit, the root of the tree of large free objects (see
+  // size_tree_insert()). With next fit, the free object the previous search
+  // stopped at and the bin it is in.
 
-void increase_calloc_calls() {
-  calloc_calls++;
-} /* increase_calloc_calls() */
+  object_header *size_tree;
+  object_header *rover;
+  int rover_bin;
 
-/*
- * Increase the number of calls to free().
- */
+  // The chunks we got from the OS, newest first, linked through the prev
+  // pointer of their end fenceposts. The next pointer of an end fencepost
+  // points back at the start of its chunk.
 
-void increase_free_calls() {
-  free_calls++;
-} /* increase_free_calls() */
+  object_header *chunk_list;
 
-/*
- * externed version of at_exit_handler(), which can be passed to atexit().
- * See atexit(3).
- */
+  // For every arena but the main one, its span of the reserved range and
+  // the end of the part of it in use
 
-extern void at_exit_handler_in_c() {
-  at_exit_handler();
-} /* at_exit_handler_in_c() */
+  char *span;
+  char *span_top;
 
-/*
- * Initialize the allocator by setting initial state
- * and making the first allocation.
- */
+  // Sum total size of the chunks, and their number
 
-void initialize() {
-  // Set this environment variable to the specified value
-  // to disable verbose logging.
+  size_t heap_size;
+  int num_chunks;
 
-#define VERBOSE_ENV_VAR "MALLOCVERBOSE"
-#define VERBOSE_DISABLE_STRING "NO"
+  // The part of the newest chunk nothing has been allocated from yet. It
+  // is still zero as it came from the OS, apart from the tags of the free
+  // object covering it, so calloc() need not clear objects carved from it.
 
-  pthread_mutex_init(&mutex, NULL);
+  char *fresh_start;
+  char *fresh_end;
 
-  // We default to verbose mode, but if it has been disabled in
-  // the environment, disable it correctly.
+  // Frees since the last automatic trim pass, and the number of passes
 
-  const char *env_verbose = getenv(VERBOSE_ENV_VAR);
-  verbose = (!env_verbose || strcmp(env_verbose, VERBOSE_DISABLE_STRING));
+  int frees_since_trim;
+  size_t trim_epoch;
 
-  // Disable printf's buffer, so that it won't call malloc and make
-  // debugging even more difficult
+#if MYMALLOC_SLABS
+  // Empty runs available for reuse, and the sentinels of the per-class run
+  // lists
 
-  setvbuf(stdout, NULL, _IONBF, 0);
+  struct slab_run *free_runs;
+  struct slab_run slab_runs[SLAB_NUM_CLASSES];
+#endif
 
-  // Get initial memory block from OS
+#if MYMALLOC_QUICK_LISTS
+  // Freed objects waiting to be coalesced, indexed by object size divided
+  // by SIZE_PRECISION and chained through the first word of their usable
+  // memory, and the length of each list
 
-  void *new_block = get_memory_from_os(ARENA_SIZE +
-                                       (2 * sizeof(object_header)) +
-                                       (2 * sizeof(object_footer)));
+  void *quick_lists[NUM_QUICK_LISTS];
+  int quick_counts[NUM_QUICK_LISTS];
+#endif
 
-  // In verbose mode register function to print statistics at exit
+#if MYMALLOC_REMOTE_FREES
+  // Objects freed while the mutex was busy. They keep their ALLOCATED
+  // status until drained, and are chained through the first word of their
+  // usable memory.
 
-  atexit(at_exit_handler_in_c);
+  void *remote_frees;
+#endif
+};
 
-  // Establish memory locations for objects within the new block
+// The arenas. arenas[0] is the main arena. arena_range is the address range
+// reserved for the spans of the others.
 
-  object_footer *start_fencepost = (object_footer *) new_block;
-  object_header *current_header =
-    (object_header *) ((char *) start_fencepost +
-                              sizeof(object_footer));
-  object_footer *current_footer =
-    (object_footer *) ((char *) current_header +
-                              ARENA_SIZE +
-                              sizeof(object_header));
-  object_header *end_fencepost =
-    (object_header *) ((char *) current_footer +
-                              sizeof(object_footer));
+static struct arena arenas[MAX_ARENAS];
+static int num_arenas;
+static char *arena_range;
+static enum arena_policy arena_policy;
+static enum fit_policy fit_policy;
 
-  // Establish fenceposts
-  // We set fencepost size to 0 as an arbitrary value which would
-  // be impossible as a value for a valid memory block
+#if MYMALLOC_ARENAS
 
-  start_fencepost->status = ALLOCATED;
-  start_fencepost->object_size = 0;
+// The arena each thread allocates from, and the next one to hand out
 
-  end_fencepost->status = ALLOCATED;
-  end_fencepost->object_size = 0;
-  end_fencepost->next = NULL;
-  end_fencepost->prev = NULL;
+static __thread struct arena *thread_arena;
+static int next_arena;
 
-  // Establish main free object
+#endif // MYMALLOC_ARENAS
 
-  current_header->status = UNALLOCATED;
-  current_header->object_size = ARENA_SIZE +
-                                sizeof(object_header) +
-                                sizeof(object_footer);
+// Start of memory pool
 
-  current_footer->status = UNALLOCATED;
-  current_footer->object_size = current_header->object_size;
+static void *mem_start;
 
-  // Initialize free list and add the new first object
+// Requests above this size are served by allocate_mapped_object()
 
-  free_list = &free_list_sentinel;
-  free_list->prev = current_header;
-  free_list->next = current_header;
-  current_header->next = free_list;
-  current_header->prev = free_list;
+static size_t mmap_threshold;
 
-  // Mark sentinel as such. Do not coalesce the sentinel.
+// Size of a page, the granularity of mmap()
 
-  free_list->status = SENTINEL;
-  free_list->object_size = 0;
+static size_t page_size;
 
-  // Set start of memory pool
+// Where OS chunks come from, and how big each one is. The size is
+// OS_CHUNK_SIZE rounded up to the granularity of the backend, or to a page
+// for the spans of arenas other than the main one.
 
-  mem_start = (char *) current_header;
-} /* initialize() */
+static enum os_backend os_backend;
+static enum huge_page_mode huge_pages;
+static size_t os_chunk_size;
+static size_t span_chunk_size;
+
+// Automatic trimming: a trim pass runs in an arena every trim_interval frees
+// there, or never if it is 0.
+
+static int trim_interval;
+
+// Total size of the slabs of all pools (see pool_create()), which are
+// mapped apart from the arenas and never given back
+
+static size_t pool_size;
+
+// Verbose mode enabled via environment variable
+// (See initialize())
+
+static int verbose;
+
+// Statistics counters (see mymalloc_stats()). They are sharded by CPU, so
+// that threads running on different CPUs never write to the same cache line,
+// and updated with relaxed atomics, so that a thread moving to another CPU
+// in the middle of an update is harmless. Readers add the shards up.
+
+#define NUM_STAT_SHARDS (64)
+
+enum stat_counter {
+  STAT_MALLOC_CALLS,
+  STAT_FREE_CALLS,
+  STAT_REALLOC_CALLS,
+  STAT_CALLOC_CALLS,
+  STAT_BYTES_ALLOCATED,
+  STAT_BYTES_FREED,
+  STAT_LOCK_CONTENTIONS,
+  STAT_OS_CHUNK_REQUESTS,
+  STAT_OS_CHUNK_RELEASES,
+  STAT_MAPPED_OBJECTS,
+  STAT_SPLITS,
+  STAT_COALESCES,
+  STAT_SIZE_CLASSES,
+  NUM_STAT_COUNTERS = STAT_SIZE_CLASSES + MYMALLOC_STAT_CLASSES
+};
+
+struct stat_shard {
+  unsigned long long counters[NUM_STAT_COUNTERS];
+} __attribute__ ((aligned(64)));
+
+static struct stat_shard stat_shards[NUM_STAT_SHARDS];
+
+// Profiling mode, enabled with the MALLOCPROFILE environment variable (see
+// initialize()), records log2 histograms of the cycles spent in each call,
+// waiting for a mutex and holding it, and of the free list nodes visited by
+// each search. Bucket k counts values in [2**(k-1), 2**k), bucket 0 counts
+// zeros. The histograms are sharded like the statistics counters.
+
+#define PROFILE_BUCKETS (65)
+
+enum profile_histogram {
+  PROFILE_MALLOC,
+  PROFILE_FREE,
+  PROFILE_REALLOC,
+  PROFILE_CALLOC,
+  PROFILE_LOCK_WAIT,
+  PROFILE_LOCK_HOLD,
+  PROFILE_SEARCH_NODES,
+  NUM_PROFILE_HISTOGRAMS
+};
+
+struct profile_shard {
+  unsigned long long buckets[NUM_PROFILE_HISTOGRAMS][PROFILE_BUCKETS];
+} __attribute__ ((aligned(64)));
+
+static int profiling;
+static struct profile_shard profile_shards[NUM_STAT_SHARDS];
+
+// Tracing mode, enabled with the MALLOCTRACE environment variable (see
+// initialize()), logs every call to trace_fd (see MyMalloc.h). Each thread
+// appends its records to a ring of its own, without locking; a background
+// thread writes the rings out every TRACE_FLUSH_INTERVAL nanoseconds, and a
+// thread finding its ring full writes it out itself. Rings of exited
+// threads are reused by new ones.
+
+#define TRACE_RING_SIZE (4096)
+#define TRACE_FLUSH_INTERVAL (10000000)
+
+struct trace_ring {
+  struct trace_ring *next;
+
+  // Whether a live thread owns the ring
+
+  int in_use;
+
+  // Records are written at head by the owner and read from tail by
+  // whoever holds trace_mutex. Both only grow.
+
+  uint64_t head;
+  uint64_t tail;
+  struct mymalloc_trace_record records[TRACE_RING_SIZE];
+};
+
+static int tracing;
+static int trace_fd;
+static pthread_key_t trace_key;
+static struct trace_ring *trace_rings;
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static object_header *add_os_chunk(struct arena *arena);
+static void profile_signal_handler(int signum);
+static void start_tracing(const char *path);
+static void flush_trace();
+static void lock_arena_mutex(struct arena *arena);
+static void unlock_arena_mutex(struct arena *arena);
+static size_t trim_heap(struct arena *arena, size_t pad, int idle_only);
+static int can_return_memory_to_os(struct arena *arena, void *memory,
+                                   size_t size);
+static void return_memory_to_os(struct arena *arena, void *memory,
+                                size_t size);
 
 /*
- * Allocate an object of size size. Ideally, we can allocate from the free list,
- * but if we don't have a free object large enough, go get more memory from the
- * OS. Return a pointer to the newly allocated memory.
- *
- * TODO: Add your code to allocate memory from the free list, instead of getting
- * it from the OS every time.
+ * Return the word in the usable memory of the free object at object where
+ * trim_heap() keeps its stamp.
  */
 
-void *allocate_object(size_t size) {
-  // SIZE_PRECISION determines how to round.
-  // By default, round up to nearest 8 bytes.
-  // It must be a power of 2.
-  // MINIMUM_SIZE is the minimum size that can be requested, not including
-  // header and footer. Smaller requests are rounded up to this minimum.
+static inline size_t *trim_stamp(object_header *object) {
+  return (size_t *) (object + 1);
+} /* trim_stamp() */
 
-#define SIZE_PRECISION (8)
-#define MINIMUM_SIZE (8)
+// The node of a free object in the size tree of its arena, right after its
+// trim stamp
 
-  if (size < MINIMUM_SIZE) {
-    size = MINIMUM_SIZE;
-  }
+struct size_node {
+  object_header *child[2];
+};
 
-  if (size%8 != 0) {
-    size = (size/8 + 1) * 8;
-  }
-  // Add the object_header/Footer to the size and round the total size
-  // up to a multiple of 8 bytes for alignment.
-  // Bitwise-and with ~(SIZE_PRECISION - 1) will set the last x bits to 0,
-  // if SIZE_PRECISION = 2**x.
+/*
+ * Return the size tree node in the usable memory of the free object at
+ * object.
+ */
 
-  size_t rounded_size = (size +
-                         sizeof(object_header) +
-                         sizeof(object_footer) +
-                         (SIZE_PRECISION - 1)) & ~(SIZE_PRECISION - 1);
-
-  // For now, naively get the memory from the OS every time.
-  // (You need to change this.)
-  
-  object_header *tmp_header = free_list->next;
-  if (free_list->next == free_list) {
-    //check if the memory has been used all up
-    //printf("i am here\n");
-    void *new_block = get_memory_from_os(ARENA_SIZE +
-                                         (2 * sizeof(object_header)) +
-                                         (2 * sizeof(object_footer)));
-    object_footer *start_fencepost = (object_footer *) new_block;
-    object_header *current_header =
-      (object_header *) ((char *) start_fencepost +
-                                  sizeof(object_footer));
-    object_footer *current_footer =
-      (object_footer *) ((char *) current_header +
-                         ARENA_SIZE +
-                         sizeof(object_header));
-    object_header *end_fencepost =
-      (object_header *) ((char *) current_footer +
-                         sizeof(object_footer));
-    start_fencepost->status = ALLOCATED;
-    start_fencepost->object_size = 0;
-    
-    end_fencepost->status = ALLOCATED;
-    end_fencepost->object_size = 0;
-    end_fencepost->next = NULL;
-    end_fencepost->prev = NULL;
-
-    current_header->status = UNALLOCATED;
-    current_header->object_size = ARENA_SIZE +
-                                  sizeof(object_header) +
-                                  sizeof(object_footer);
-    
-    current_footer->status = UNALLOCATED;
-    current_footer->object_size = current_header->object_size;
-    free_list->prev = current_header;
-    free_list->next = current_header;
-    current_header->next = free_list;
-    current_header->prev = free_list;
-  }
-  tmp_header = free_list->next;
-  while (tmp_header != free_list) {
-    
-    //decide which approach: split, not split and ask for new memory
-    int blank_size = tmp_header->object_size - sizeof(object_footer)
-                                        - sizeof(object_header);
-    if (tmp_header->object_size >=rounded_size + sizeof(object_header)
-                                               + sizeof(object_footer)
-    + MINIMUM_SIZE) {
-      object_footer *new_footer =
-        (object_footer *) ((char *) tmp_header + rounded_size
-                                  - sizeof(object_footer));
-      object_footer *old_footer =
-        (object_footer *) ((char *) tmp_header
-                                  + sizeof(object_header)
-                                  + blank_size);
-      old_footer->object_size = old_footer->object_size - rounded_size;
-      tmp_header->status = ALLOCATED;
-      tmp_header->object_size = rounded_size;
-      new_footer->object_size = rounded_size;
-      new_footer->status = ALLOCATED;
-      object_header *new_header =
-        (object_header *) ((char *) tmp_header + rounded_size);
-
-      new_header->status = UNALLOCATED;
-      old_footer->status = UNALLOCATED;
-      new_header->object_size = old_footer->object_size;
-      tmp_header->prev->next = new_header;
-      new_header->next = tmp_header->next;
-      new_header->prev = tmp_header->prev;
-      new_header->next->prev = new_header;
-      break;
-    }
-    else if ((tmp_header->object_size >= rounded_size) &&
-             (tmp_header->object_size < rounded_size
-                                      + sizeof(object_header)
-                                      + sizeof(object_footer)
-    + MINIMUM_SIZE)) { /*situation of 
-                                                          don't need split*/
-      // printf("anybody see me ?????\n");
-      size = tmp_header->object_size - sizeof(object_header)
-                                     - sizeof(object_footer);
-      object_footer *tmp_footer =
-        (object_footer*)((char*)tmp_header +
-                               size + sizeof(object_header));
-      tmp_header->status = ALLOCATED;
-      tmp_footer->status = ALLOCATED;
-      tmp_header->next->prev = tmp_header->prev;
-      tmp_header->prev->next = tmp_header->next;
-      // printf("anybody see me finish?????\n");
-      break;
-    }
-    else {      /* situation of need to look keep looking*/
-      if (tmp_header->next == free_list) {
-
-        //situation when there is not a block big enough
-
-        void *new_block = get_memory_from_os(ARENA_SIZE +
-                                         (2 * sizeof(object_header)) +
-                                         (2 * sizeof(object_footer)));
-        object_footer *start_fencepost = (object_footer *) new_block;
-        object_header *current_header =
-          (object_header *) ((char *) start_fencepost +
-                             sizeof(object_footer));
-        object_footer *current_footer =
-          (object_footer *) ((char *) current_header +
-                             ARENA_SIZE +
-                             sizeof(object_header));
-        object_header *end_fencepost =
-          (object_header *) ((char *) current_footer +
-                             sizeof(object_footer));
-        start_fencepost->status = ALLOCATED;
-        start_fencepost->object_size = 0;
-
-        end_fencepost->status = ALLOCATED;
-        end_fencepost->object_size = 0;
-        end_fencepost->next = NULL;
-        end_fencepost->prev = NULL;
-
-        current_header->status = UNALLOCATED;
-        current_header->object_size = ARENA_SIZE +
-                                      sizeof(object_header) +
-                                      sizeof(object_footer);
-
-        current_footer->status = UNALLOCATED;
-        current_footer->object_size = current_header->object_size;
-        tmp_header->next->prev = current_header;
-        current_header->next = tmp_header->next;
-        tmp_header->next = current_header;
-        current_header->prev = tmp_header;
-      }
-      tmp_header = tmp_header->next;
-    }
-  }
-  
-
-//object_header *new_object = (object_header *) new_block;
-//  new_object->object_size = rounded_size;
+static inline struct size_node *size_node(object_header *object) {
+  return (struct size_node *) (trim_stamp(object) + 1);
+} /* size_node() */
 
-  // Return a pointer to usable memory
+#if MYMALLOC_THREAD_CACHE
 
-  return (void *) (tmp_header + 1);
-} /* allocate_object() */
+// Requests up to TCACHE_MAX_SIZE bytes are served from per-thread caches,
+// one bin for every multiple of 8 bytes. A miss takes the mutex once and
+// refills the bin with TCACHE_BATCH blocks; once a bin holds more than
+// TCACHE_MAX_COUNT blocks, TCACHE_BATCH of them are flushed back under a
+// single lock.
+
+#define TCACHE_MAX_SIZE (512)
+#define TCACHE_NUM_BINS (TCACHE_MAX_SIZE / 8)
+#define TCACHE_BATCH (16)
+#define TCACHE_MAX_COUNT (2 * TCACHE_BATCH)
+
+// Cached blocks keep their ALLOCATED status, so they are never coalesced,
+// and are chained through the first word of their usable memory.
+
+struct tcache_bin {
+  void *head;
+  int count;
+};
+
+static __thread struct tcache_bin tcache[TCACHE_NUM_BINS];
+static __thread int tcache_registered;
+static pthread_key_t tcache_key;
+
+static void tcache_flush_all(void *unused);
+
+#endif // MYMALLOC_THREAD_CACHE
+
+#if MYMALLOC_REMOTE_FREES
+
+static void remote_free_drain(struct arena *arena);
+
+#endif // MYMALLOC_REMOTE_FREES
+
+
+#if MYMALLOC_COMPACT_HEADERS
+
+// Low bits of object_size in the compact layout
+
+#define STATUS_MASK ((size_t) 3)
+#define PREV_ALLOCATED ((size_t) 4)
+#define FLAGS_MASK ((size_t) (SIZE_PRECISION - 1))
+
+#endif // MYMALLOC_COMPACT_HEADERS
 
 /*
- * Free an object. ptr is a pointer to the usable block of memory in
- * the object. If possible, coalesce the object, then add to the free list.
- *
- * TODO: Add your code to free the object
+ * Return the size of the object at object, including its header and footer.
  */
 
-void free_object(void *ptr) {
+static inline size_t get_object_size(object_header *object) {
+#if MYMALLOC_COMPACT_HEADERS
+  return object->object_size & ~FLAGS_MASK;
+#else
+  return object->object_size;
+#endif
+} /* get_object_size() */
 
-  //first find the right location where the address of the freed object
-  //should be at,
-  //and then find out that if it should merge with adjacent blocks
+/*
+ * Return the status of the object at object.
+ */
 
-  object_header *tmp_header = (object_header*)((char *) ptr
-      - sizeof(object_header));
-  object_header *iter_header = free_list;
-  while ((iter_header->next < tmp_header)
-  && (iter_header->next != free_list)) {
-    iter_header = iter_header->next;
-    // printf("here we have a loop");
-  }
-  object_header *old_header = iter_header->next;
-  iter_header->next = tmp_header;
-  tmp_header->prev = iter_header;
-  tmp_header->next = old_header;
-  old_header->prev = tmp_header;
-  object_footer *tmp_footer = (object_footer*)((char*)tmp_header
-                                               + tmp_header->object_size
-                                               - sizeof(object_footer));
-  tmp_header->status = UNALLOCATED;
-  tmp_footer->status = UNALLOCATED;
-  object_header *next_header = (object_header*)((char *)tmp_header
-                                               + tmp_header->object_size);
-  
-  object_footer *next_footer = (object_footer*)((char *)next_header
-                                               + next_header->object_size
-                                               - sizeof(object_footer));
-  
-  object_footer *prev_footer = (object_footer*)((char *)tmp_header
-                                               - sizeof(object_footer));
-  
-  object_header *prev_header = (object_header*)((char *)tmp_header
-                                               - prev_footer->object_size);
-  
-  if ((next_header->status == UNALLOCATED)
-      && (prev_footer->status == UNALLOCATED)
-      && (next_header->object_size != 0)
-  && (prev_footer->object_size != 0)) {       // merge both
-    //printf("entered 1\n");
-    prev_header->object_size += tmp_header->object_size
-                              + next_header->object_size;
-    next_footer->object_size = prev_header->object_size;
-    prev_header->next = next_header->next;
-    prev_header->next->prev = prev_header;
-  }
-  else if (((next_header->status == UNALLOCATED)
-            && (prev_footer->status == ALLOCATED))||
-           ((next_header->status == UNALLOCATED)
-            && (prev_footer->status == UNALLOCATED)
-  && (next_header->object_size != 0))) {    // merge right
-    //printf("entered 2\n");
-    tmp_header->object_size += next_header->object_size;
-    next_footer->object_size =  tmp_header->object_size;
-    tmp_header->next = next_header->next;
-    tmp_header->next->prev = tmp_header;
-  }
-  else if (((next_header->status == ALLOCATED)
-            && (prev_footer->status == UNALLOCATED))||
-           ((next_header->status == UNALLOCATED)
-            && (prev_footer->status == UNALLOCATED)
-  && (prev_footer->object_size != 0))) {  // merge left
-    // printf("entered 3\n");
-    prev_header->object_size += tmp_header->object_size;
-    tmp_footer->object_size = prev_header->object_size;
-    prev_header->next = tmp_header->next;
-    prev_header->next->prev = prev_header;
-  }
-  else {                                          // don't merge
-    //printf("entered 4\n");
-  }
-  return;
-  
-} /* free_object() */
+static inline enum allocation_status get_object_status(object_header *object) {
+#if MYMALLOC_COMPACT_HEADERS
+  return (enum allocation_status) (object->object_size & STATUS_MASK);
+#else
+  return object->status;
+#endif
+} /* get_object_status() */
 
 /*
- * Return the size of the object pointed by ptr. We assume that ptr points 
- * usable memory in a valid obejct.
+ * Return whether the object in memory right before object is free.
  */
 
-size_t object_size(void *ptr) {
-  // ptr will point at the end of the header, so subtract the size of the
-  // header to get the start of the header.
+static inline int prev_object_is_free(object_header *object) {
+#if MYMALLOC_COMPACT_HEADERS
+  return !(object->object_size & PREV_ALLOCATED);
+#else
+  object_footer *prev_footer =
+    (object_footer *) ((char *) object - sizeof(object_footer));
+  return prev_footer->status == UNALLOCATED;
+#endif
+} /* prev_object_is_free() */
 
-  object_header *object =
-    (object_header *) ((char *) ptr - sizeof(object_header));
+/*
+ * Return the header of the object whose usable memory starts at ptr.
+ */
 
-  return object->object_size;
-} /* object_size() */
+static inline object_header *header_of(void *ptr) {
+  return (object_header *) ((char *) ptr - HEADER_SIZE);
+} /* header_of() */
 
 /*
- * Print statistics on heap size and
- * how many times each function has been called.
+ * Return the usable memory of the object at object.
  */
 
-void print_stats() {
-  printf("\n-------------------\n");
+static inline void *usable_memory_of(object_header *object) {
+  return (void *) ((char *) object + HEADER_SIZE);
+} /* usable_memory_of() */
+
+/*
+ * Write the header of a mapped object, size bytes long including the bytes
+ * of its mapping before the header.
+ */
 
-  printf("HeapSize:\t%zd bytes\n", heap_size);
-  printf("# mallocs:\t%d\n", malloc_calls);
-  printf("# reallocs:\t%d\n", realloc_calls);
-  printf("# callocs:\t%d\n", calloc_calls);
-  printf("# frees:\t%d\n", free_calls);
+static inline void set_mapped_tags(object_header *object, size_t size) {
+#if MYMALLOC_COMPACT_HEADERS
+  object->object_size = size | MAPPED;
+#else
+  object->object_size = size;
+  object->status = MAPPED;
+  object->next = NULL;
+  object->prev = NULL;
+#endif
+} /* set_mapped_tags() */
 
-  printf("\n-------------------\n");
-} /* print_stats() */
+/*
+ * Return the start of the mapping of the mapped object at object. The header
+ * always lies in the first page of the mapping: at MAPPED_HEADER_OFFSET
+ * bytes, or further in for an object aligned by allocate_mapped_object().
+ */
+
+static inline char *mapping_of(object_header *object) {
+  return (char *) ((uintptr_t) object & ~(uintptr_t) (page_size - 1));
+} /* mapping_of() */
 
 /*
- * Print a representation of the current free list.
- * For each object in the free list, show the offset (distance in memory from
- * the start of the memory pool, mem_start) and the size of the object.
+ * Write the header of a fencepost or free list sentinel: a zero-sized
+ * object with the given status that is never coalesced.
  */
 
-void print_list() {
-  pthread_mutex_lock(&mutex);
+static inline void set_fencepost_tags(object_header *object,
+                                      enum allocation_status status) {
+#if MYMALLOC_COMPACT_HEADERS
+  object->object_size = status;
+#else
+  object->object_size = 0;
+  object->status = status;
+#endif
+} /* set_fencepost_tags() */
 
-  printf("FreeList: ");
+/*
+ * Return the statistics shard of the calling CPU. Operations that count
+ * several statistics look it up once and pass it to shard_count(), and set
+ * it as the stat_shard of the arenas they lock.
+ */
 
-  object_header *ptr = free_list->next;
+static inline struct stat_shard *current_stat_shard() {
+  int cpu = sched_getcpu();
+  return &stat_shards[(cpu >= 0) ? cpu % NUM_STAT_SHARDS : 0];
+} /* current_stat_shard() */
 
-  while (ptr != free_list) {
-    long offset = (long) ptr - (long) mem_start;
-    printf("[offset:%ld,size:%zd]", offset, ptr->object_size);
-    ptr = ptr->next;
-    if (ptr != free_list) {
-      printf("->");
-    }
+/*
+ * Add amount to a statistics counter in shard.
+ */
+
+static inline void shard_count(struct stat_shard *shard,
+                               enum stat_counter counter, size_t amount) {
+  __atomic_fetch_add(&shard->counters[counter], amount, __ATOMIC_RELAXED);
+} /* shard_count() */
+
+/*
+ * Add amount to a statistics counter, in the shard of the calling CPU. Only
+ * for counts outside the operations, or on their slow paths.
+ */
+
+static inline void count(enum stat_counter counter, size_t amount) {
+  shard_count(current_stat_shard(), counter, amount);
+} /* count() */
+
+/*
+ * Return the statistics size class of a request of size bytes: 0 up to
+ * 8 bytes, then one class per power of two.
+ */
+
+static int stat_size_class(size_t size) {
+  if (size <= 8) {
+    return 0;
   }
-  printf("\n");
 
-  pthread_mutex_unlock(&mutex);
-} /* print_list() */
+  int log2 = (int) (sizeof(unsigned long) * 8) - 1 -
+             __builtin_clzl((unsigned long) (size - 1));
+  int size_class = log2 - 2;
+  return (size_class < MYMALLOC_STAT_CLASSES) ? size_class :
+                                                MYMALLOC_STAT_CLASSES - 1;
+} /* stat_size_class() */
 
 /*
- * Use sbrk() to get the memory from the OS. See sbrk(2).
+ * Return the time stamp counter, or the time in nanoseconds on processors
+ * without one.
  */
 
-void *get_memory_from_os(size_t size) {
-  heap_size += size;
+static inline uint64_t read_cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __builtin_ia32_rdtsc();
+#else
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000 + (uint64_t) now.tv_nsec;
+#endif
+} /* read_cycles() */
 
-  void *new_block = sbrk(size);
+/*
+ * Add value to a profiling histogram, in the shard of the calling CPU.
+ */
 
-  num_chunks++;
+static void profile_record(enum profile_histogram histogram, uint64_t value) {
+  int cpu = sched_getcpu();
+  struct profile_shard *shard =
+    &profile_shards[(cpu >= 0) ? cpu % NUM_STAT_SHARDS : 0];
+  int bucket = (value == 0) ? 0 : 64 - __builtin_clzll(value);
 
-  return new_block;
-} /* get_memory_from_os() */
+  __atomic_fetch_add(&shard->buckets[histogram][bucket], 1, __ATOMIC_RELAXED);
+} /* profile_record() */
 
 /*
- * Run when the program exists, and prints final statistics about the allocator.
+ * Return the start time of an operation to profile, or 0 when not
+ * profiling.
  */
 
-void at_exit_handler() {
-  if (verbose) {
-    print_stats();
+static inline uint64_t profile_start() {
+  return profiling ? read_cycles() : 0;
+} /* profile_start() */
+
+/*
+ * Record the cycles since start, returned by profile_start(), in a
+ * profiling histogram.
+ */
+
+static inline void profile_end(enum profile_histogram histogram,
+                               uint64_t start) {
+  if (profiling) {
+    profile_record(histogram, read_cycles() - start);
   }
-} /* at_exit_handler() */
+} /* profile_end() */
 
+/*
+ * Increments the number of calls to malloc(), in shard.
+ */
 
+void increase_malloc_calls(struct stat_shard *shard) {
+  shard_count(shard, STAT_MALLOC_CALLS, 1);
+} /* increase_malloc_calls() */
 
-//
-// C interface
-//
+/*
+ * Increase the number of calls to realloc(), in shard.
+ */
 
+void increase_realloc_calls(struct stat_shard *shard) {
+  shard_count(shard, STAT_REALLOC_CALLS, 1);
+} /* increase_realloc_calls() */
 
 /*
- * Allocates size bytes of memory and returns the pointer to the
- * newly-allocated memory. See malloc(3).
+ * Increase the number of calls to calloc(), in shard.
  */
 
-extern void *malloc(size_t size) {
-  pthread_mutex_lock(&mutex);
-  increase_malloc_calls();
+void increase_calloc_calls(struct stat_shard *shard) {
+  shard_count(shard, STAT_CALLOC_CALLS, 1);
+} /* increase_calloc_calls() */
+
+/*
+ * Increase the number of calls to free(), in shard.
+ */
 
-  void *memory = allocate_object(size);
+void increase_free_calls(struct stat_shard *shard) {
+  shard_count(shard, STAT_FREE_CALLS, 1);
+} /* increase_free_calls() */
 
-  pthread_mutex_unlock(&mutex);
+/*
+ * externed version of at_exit_handler(), which can be passed to atexit().
+ * See atexit(3).
+ */
 
-  return memory;
-} /* malloc() */
+extern void at_exit_handler_in_c() {
+  at_exit_handler();
+} /* at_exit_handler_in_c() */
 
 /*
- * Frees a block of memory allocated by malloc(), calloc(), or realloc().
- * See malloc(3).
+ * Initialize an arena with empty free lists and no chunks.
  */
 
-extern void free(void *ptr) {
-  pthread_mutex_lock(&mutex);
-  increase_free_calls();
+static void initialize_arena(struct arena *arena) {
+  pthread_mutex_init(&arena->mutex, NULL);
 
-  if (ptr != NULL) {
-    free_object(ptr);
+  // Initialize the free lists. Mark sentinels as such.
+  // Do not coalesce the sentinels.
+
+  for (int bin = 0; bin < NUM_BINS; bin++) {
+    arena->free_list[bin].next = &arena->free_list[bin];
+    arena->free_list[bin].prev = &arena->free_list[bin];
+    set_fencepost_tags(&arena->free_list[bin], SENTINEL);
   }
 
-  pthread_mutex_unlock(&mutex);
-} /* free() */
+  // Start past the epoch a cleared trim stamp belongs to, so that the first
+  // trim pass does not take every free object for idle
+
+  arena->trim_epoch = 1;
+  arena->stat_shard = &stat_shards[0];
+
+#if MYMALLOC_SLABS
+  for (int i = 0; i < SLAB_NUM_CLASSES; i++) {
+    arena->slab_runs[i].next = &arena->slab_runs[i];
+    arena->slab_runs[i].prev = &arena->slab_runs[i];
+  }
+#endif
+} /* initialize_arena() */
 
 /*
- * Resizes the block of memory at ptr, which was allocated by
- * malloc(), realloc(), or calloc(), and returns a pointer to
- * the new resized block. See malloc(3).
+ * Initialize the allocator by setting initial state
+ * and making the first allocation.
  */
 
-extern void *realloc(void *ptr, size_t size) {
-  pthread_mutex_lock(&mutex);
-  increase_realloc_calls();
+void initialize() {
+  // Set this environment variable to the specified value
+  // to disable verbose logging.
 
-  void *new_ptr = allocate_object(size);
+#define VERBOSE_ENV_VAR "MALLOCVERBOSE"
+#define VERBOSE_DISABLE_STRING "NO"
 
-  pthread_mutex_unlock(&mutex);
+#if MYMALLOC_THREAD_CACHE
+  // Flush a thread's cache back to the free list when the thread exits
 
-  // Copy old object only if ptr is non-null
+  pthread_key_create(&tcache_key, tcache_flush_all);
+#endif
 
-  if (ptr != NULL) {
-    // Copy everything from the old ptr.
-    // We don't need to hold the mutex here because it is undefined behavior
-    // (a double free) for the calling program to free() or realloc() this
-    // memory once realloc() has already been called.
+  // We default to verbose mode, but if it has been disabled in
+  // the environment, disable it correctly.
 
-    size_t size_to_copy =  object_size(ptr);
-    if (size_to_copy > size) {
-      // If we are shrinking, don't write past the end of the new block
+  const char *env_verbose = getenv(VERBOSE_ENV_VAR);
+  verbose = (!env_verbose || strcmp(env_verbose, VERBOSE_DISABLE_STRING));
 
-      size_to_copy = size;
-    }
+  // Disable printf's buffer, so that it won't call malloc and make
+  // debugging even more difficult
 
-    memcpy(new_ptr, ptr, size_to_copy);
+  setvbuf(stdout, NULL, _IONBF, 0);
+
+  // Set this environment variable to a size in bytes to serve smaller
+  // requests with mmap() as well.
+
+#define MMAP_THRESHOLD_ENV_VAR "MALLOCMMAPTHRESHOLD"
+
+  page_size = (size_t) sysconf(_SC_PAGESIZE);
+  mmap_threshold = MMAP_THRESHOLD;
 
-    pthread_mutex_lock(&mutex);
-    free_object(ptr);
-    pthread_mutex_unlock(&mutex);
+  const char *env_threshold = getenv(MMAP_THRESHOLD_ENV_VAR);
+  if (env_threshold) {
+    mmap_threshold = (size_t) strtoul(env_threshold, NULL, 10);
+  }
+  if (mmap_threshold > ARENA_SIZE) {
+    mmap_threshold = ARENA_SIZE;
   }
 
-  return new_ptr;
-} /* realloc() */
+  // Set these environment variables to choose where OS chunks come from
+  // ("sbrk" or "mmap") and, for mmap, which huge pages to use
+  // ("thp" or "hugetlb").
 
-/*
- * Allocates contiguous memory large enough to fit num_elems elements
- * of size elem_size. Initialize the memory to 0. Return a pointer to
- * the beginning of the newly-allocated memory. See malloc(3).
- */
+#define BACKEND_ENV_VAR "MALLOCBACKEND"
+#define HUGE_PAGES_ENV_VAR "MALLOCHUGEPAGES"
 
-extern void *calloc(size_t num_elems, size_t elem_size) {
-  pthread_mutex_lock(&mutex);
-  increase_calloc_calls();
+  os_backend = MYMALLOC_MMAP_ARENAS ? MMAP_BACKEND : SBRK_BACKEND;
+
+  const char *env_backend = getenv(BACKEND_ENV_VAR);
+  if (env_backend) {
+    os_backend = strcmp(env_backend, "mmap") ? SBRK_BACKEND : MMAP_BACKEND;
+  }
 
-  // Find total size needed
+  const char *env_huge_pages = getenv(HUGE_PAGES_ENV_VAR);
+  if (env_huge_pages && (os_backend == MMAP_BACKEND)) {
+    if (!strcmp(env_huge_pages, "thp")) {
+      huge_pages = TRANSPARENT_HUGE_PAGES;
+    }
+    else if (!strcmp(env_huge_pages, "hugetlb")) {
+      huge_pages = HUGETLB_PAGES;
+    }
+  }
 
-  size_t size = num_elems * elem_size;
+  size_t granularity = SIZE_PRECISION;
+  if (huge_pages == HUGETLB_PAGES) {
+    granularity = HUGE_PAGE_SIZE;
+  }
+  else if (os_backend == MMAP_BACKEND) {
+    granularity = page_size;
+  }
+  os_chunk_size = (OS_CHUNK_SIZE + (granularity - 1)) & ~(granularity - 1);
 
-  void *ptr = allocate_object(size);
+  // Set these environment variables to the number of arenas, and to "cpu"
+  // to assign threads to arenas by CPU.
 
-  pthread_mutex_unlock(&mutex);
+#define ARENAS_ENV_VAR "MALLOCARENAS"
+#define ARENA_POLICY_ENV_VAR "MALLOCARENAPOLICY"
 
-  if (ptr) {
-    // No error, so initialize chunk with 0s
+  num_arenas = MYMALLOC_ARENAS ? (int) sysconf(_SC_NPROCESSORS_ONLN) : 1;
 
-    memset(ptr, 0, size);
+  const char *env_arenas = getenv(ARENAS_ENV_VAR);
+  if (env_arenas) {
+    num_arenas = atoi(env_arenas);
+  }
+  if (num_arenas < 1) {
+    num_arenas = 1;
+  }
+  if (num_arenas > MAX_ARENAS) {
+    num_arenas = MAX_ARENAS;
   }
 
-  return ptr;
+  const char *env_policy = getenv(ARENA_POLICY_ENV_VAR);
+  if (env_policy && !strcmp(env_policy, "cpu")) {
+    arena_policy = CPU_ARENAS;
+  }
+
+  // Reserve the spans of the arenas other than the main one. Nothing is
+  // committed until add_os_chunk() needs it. If the reservation fails,
+  // there is only the main arena.
+
+  span_chunk_size = (os_chunk_size + (page_size - 1)) & ~(page_size - 1);
+  if (num_arenas > 1) {
+    arena_range = (char *) mmap(NULL, (num_arenas - 1) * ARENA_SPAN,
+                                PROT_NONE,
+                                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                                -1, 0);
+    if (arena_range == MAP_FAILED) {
+      arena_range = NULL;
+      num_arenas = 1;
+    }
+  }
+
+  for (int i = 0; i < num_arenas; i++) {
+    initialize_arena(&arenas[i]);
+    if ((MAX_ARENAS > 1) && (i > 0)) {
+      arenas[i].span = arena_range + (i - 1) * ARENA_SPAN;
+      arenas[i].span_top = arenas[i].span;
+    }
+  }
+
+#if MYMALLOC_SLABS
+  // Reserve address space for slab runs. Pages are only committed once
+  // they are touched. If the reservation fails, small requests simply use
+  // the free lists.
+
+  char *region = (char *) mmap(NULL, SLAB_REGION_SIZE + SLAB_RUN_SIZE,
+                               PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                               -1, 0);
+  if (region != MAP_FAILED) {
+    slab_region = (char *) (((uintptr_t) region + (SLAB_RUN_SIZE - 1)) &
+                            ~(uintptr_t) (SLAB_RUN_SIZE - 1));
+    slab_region_used = slab_region;
+  }
+#endif
+
+  // Set this environment variable to the number of frees between automatic
+  // trim passes.
+
+#define TRIM_IDLE_ENV_VAR "MALLOCTRIMIDLE"
+
+  const char *env_trim = getenv(TRIM_IDLE_ENV_VAR);
+  if (env_trim) {
+    trim_interval = atoi(env_trim);
+  }
+
+  // Set this environment variable to "best" or "next" to change the fit
+  // policy. It must be known before the first free object is.
+
+#define FIT_ENV_VAR "MALLOCFIT"
+
+  const char *env_fit = getenv(FIT_ENV_VAR);
+  if (env_fit && !strcmp(env_fit, "best")) {
+    fit_policy = BEST_FIT;
+  }
+  else if (env_fit && !strcmp(env_fit, "next")) {
+    fit_policy = NEXT_FIT;
+  }
+
+  // Set this environment variable to profile the allocator and print the
+  // histograms at exit, and the other one to a signal number to also print
+  // them whenever that signal is received.
+
+#define PROFILE_ENV_VAR "MALLOCPROFILE"
+#define PROFILE_SIGNAL_ENV_VAR "MALLOCPROFILESIGNAL"
+
+  const char *env_profile = getenv(PROFILE_ENV_VAR);
+  profiling = (env_profile && strcmp(env_profile, "0"));
+
+  const char *env_profile_signal = getenv(PROFILE_SIGNAL_ENV_VAR);
+  if (profiling && env_profile_signal) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = profile_signal_handler;
+    action.sa_flags = SA_RESTART;
+    sigaction(atoi(env_profile_signal), &action, NULL);
+  }
+
+  // Get initial memory block from OS for the main arena
+
+  object_header *first_object = add_os_chunk(&arenas[0]);
+
+  // In verbose mode register function to print statistics at exit
+
+  atexit(at_exit_handler_in_c);
+
+  // Set start of memory pool
+
+  mem_start = (char *) first_object;
+
+  // Set this environment variable to the name of a file to log every call
+  // to it.
+
+#define TRACE_ENV_VAR "MALLOCTRACE"
+
+  const char *env_trace = getenv(TRACE_ENV_VAR);
+  if (env_trace && (*env_trace != '\0')) {
+    start_tracing(env_trace);
+  }
+} /* initialize() */
+
+/*
+ * Write the header and footer of the object at object, which is size bytes
+ * long including header and footer.
+ *
+ * With compact headers, only free objects get a footer, the object keeps its
+ * own PREV_ALLOCATED flag, and the flag of the object right after it is
+ * updated. An object created by a split therefore gets a correct flag once
+ * the object before it has been written.
+ *
+ * A free object also gets its trim stamp cleared: with a new extent, it is
+ * neither idle nor released as far as trim_heap() knows. Objects too small
+ * to hold a stamp are never trimmed.
+ */
+
+static void set_object_tags(object_header *object, size_t size,
+                            enum allocation_status status) {
+  object_footer *footer =
+    (object_footer *) ((char *) object + size - sizeof(object_footer));
+
+#if MYMALLOC_COMPACT_HEADERS
+  object_header *next_header = (object_header *) ((char *) object + size);
+
+  object->object_size = size | status |
+                        (object->object_size & PREV_ALLOCATED);
+  if (status == UNALLOCATED) {
+    footer->object_size = size;
+    next_header->object_size &= ~PREV_ALLOCATED;
+  }
+  else {
+    next_header->object_size |= PREV_ALLOCATED;
+  }
+#else
+  object->object_size = size;
+  object->status = status;
+  footer->object_size = size;
+  footer->status = status;
+#endif
+
+  if ((status == UNALLOCATED) &&
+      ((char *) (trim_stamp(object) + 1) <= (char *) footer)) {
+    *trim_stamp(object) = 0;
+  }
+} /* set_object_tags() */
+
+/*
+ * Return the index of the free list that holds free objects of the given size
+ * (header and footer included). Without MYMALLOC_SEGREGATED there is a
+ * single free list.
+ */
+
+static int bin_index(size_t size) {
+#if MYMALLOC_SEGREGATED
+  size_t usable = size - OBJECT_OVERHEAD;
+
+  if (usable <= SMALL_BIN_MAX) {
+    return (int) (usable / SIZE_PRECISION) - 1;
+  }
+
+  // floor(log2(usable - 1)) selects the range (2**k, 2**(k+1)]
+
+  int log2 = (int) (sizeof(unsigned long) * 8) - 1 -
+             __builtin_clzl((unsigned long) (usable - 1));
+  int bin = NUM_SMALL_BINS + log2 - SMALL_BIN_SHIFT;
+  return (bin < NUM_BINS) ? bin : NUM_BINS - 1;
+#else
+  return 0;
+#endif
+} /* bin_index() */
+
+#if MYMALLOC_SEGREGATED
+
+/*
+ * Return the first bin at or after bin from whose free list is not empty,
+ * or -1 if there is none.
+ */
+
+static int next_nonempty_bin(struct arena *arena, int from) {
+  for (int word = from / 64; word < NUM_BITMAP_WORDS; word++) {
+    uint64_t bits = arena->bin_bitmap[word];
+    if (word == from / 64) {
+      bits &= ~(uint64_t) 0 << (from % 64);
+    }
+    if (bits != 0) {
+      return (word * 64) + __builtin_ctzll(bits);
+    }
+  }
+  return -1;
+} /* next_nonempty_bin() */
+
+#endif // MYMALLOC_SEGREGATED
+
+//
+// Size tree
+//
+// With best fit, the free objects of at least SIZE_TREE_MIN bytes are also
+// kept in a treap ordered by size, then address. The priority of a node is
+// a hash of its address, so the tree stays balanced on average without
+// storing anything but the two child pointers.
+//
+
+/*
+ * Return whether the free object at object belongs in the size tree.
+ */
+
+static inline int in_size_tree(object_header *object) {
+  return (fit_policy == BEST_FIT) &&
+         (get_object_size(object) >= SIZE_TREE_MIN);
+} /* in_size_tree() */
+
+/*
+ * Return whether the free object at a comes before the one at b in the size
+ * tree.
+ */
+
+static inline int size_tree_less(object_header *a, object_header *b) {
+  size_t a_size = get_object_size(a);
+  size_t b_size = get_object_size(b);
+  return (a_size < b_size) || ((a_size == b_size) && (a < b));
+} /* size_tree_less() */
+
+/*
+ * Return the treap priority of the node of the free object at object.
+ */
+
+static inline uint64_t size_tree_priority(object_header *object) {
+  uint64_t hash = (uint64_t) (uintptr_t) object;
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  return hash;
+} /* size_tree_priority() */
+
+/*
+ * Insert the free object at object into the tree rooted at root. Return the
+ * new root.
+ */
+
+static object_header *size_tree_insert(object_header *root,
+                                       object_header *object) {
+  if (root == NULL) {
+    size_node(object)->child[0] = NULL;
+    size_node(object)->child[1] = NULL;
+    return object;
+  }
+
+  int dir = size_tree_less(root, object);
+  struct size_node *node = size_node(root);
+  node->child[dir] = size_tree_insert(node->child[dir], object);
+
+  // Rotate the child up if it outranks root
+
+  object_header *child = node->child[dir];
+  if (size_tree_priority(child) > size_tree_priority(root)) {
+    node->child[dir] = size_node(child)->child[!dir];
+    size_node(child)->child[!dir] = root;
+    return child;
+  }
+  return root;
+} /* size_tree_insert() */
+
+/*
+ * Merge the trees rooted at left and right, every node of left coming
+ * before every node of right. Return the new root.
+ */
+
+static object_header *size_tree_merge(object_header *left,
+                                      object_header *right) {
+  if (left == NULL) {
+    return right;
+  }
+  if (right == NULL) {
+    return left;
+  }
+
+  if (size_tree_priority(left) > size_tree_priority(right)) {
+    struct size_node *node = size_node(left);
+    node->child[1] = size_tree_merge(node->child[1], right);
+    return left;
+  }
+  struct size_node *node = size_node(right);
+  node->child[0] = size_tree_merge(left, node->child[0]);
+  return right;
+} /* size_tree_merge() */
+
+/*
+ * Remove the free object at object, which must still have the size it was
+ * inserted with, from the tree rooted at root. Return the new root.
+ */
+
+static object_header *size_tree_remove(object_header *root,
+                                       object_header *object) {
+  if (root == object) {
+    struct size_node *node = size_node(object);
+    return size_tree_merge(node->child[0], node->child[1]);
+  }
+
+  int dir = size_tree_less(root, object);
+  struct size_node *node = size_node(root);
+  node->child[dir] = size_tree_remove(node->child[dir], object);
+  return root;
+} /* size_tree_remove() */
+
+/*
+ * Return the smallest free object of arena's size tree with at least size
+ * bytes, the lowest one in memory among equals, or NULL if there is none.
+ */
+
+static object_header *size_tree_find(struct arena *arena, size_t size) {
+  object_header *best = NULL;
+  object_header *object = arena->size_tree;
+  uint64_t visited = 0;
+
+  while (object != NULL) {
+    visited++;
+    if (get_object_size(object) >= size) {
+      best = object;
+      object = size_node(object)->child[0];
+    }
+    else {
+      object = size_node(object)->child[1];
+    }
+  }
+
+  if (profiling) {
+    profile_record(PROFILE_SEARCH_NODES, visited);
+  }
+  return best;
+} /* size_tree_find() */
+
+/*
+ * Add a free object to the free list for its size: at the head, or at its
+ * place in address order with MYMALLOC_ADDRESS_ORDERED.
+ */
+
+static void free_list_insert(struct arena *arena, object_header *object) {
+  int bin = bin_index(get_object_size(object));
+  object_header *sentinel = &arena->free_list[bin];
+  object_header *iter_header = sentinel;
+
+#if MYMALLOC_ADDRESS_ORDERED
+  while ((iter_header->next != sentinel) && (iter_header->next < object)) {
+    iter_header = iter_header->next;
+  }
+#endif
+
+  object->prev = iter_header;
+  object->next = iter_header->next;
+  object->next->prev = object;
+  iter_header->next = object;
+
+  if (in_size_tree(object)) {
+    arena->size_tree = size_tree_insert(arena->size_tree, object);
+  }
+
+#if MYMALLOC_SEGREGATED
+  arena->bin_bitmap[bin / 64] |= (uint64_t) 1 << (bin % 64);
+#endif
+} /* free_list_insert() */
+
+/*
+ * Remove an object from the free list it is on.
+ */
+
+static void free_list_remove(struct arena *arena, object_header *object) {
+  object->prev->next = object->next;
+  object->next->prev = object->prev;
+
+  if (in_size_tree(object)) {
+    arena->size_tree = size_tree_remove(arena->size_tree, object);
+  }
+  if (arena->rover == object) {
+    arena->rover = object->next;
+  }
+
+#if MYMALLOC_SEGREGATED
+  // If only the sentinel is left, the list is now empty
+
+  object_header *sentinel = object->next;
+  if ((get_object_status(sentinel) == SENTINEL) &&
+      (sentinel->next == sentinel)) {
+    int bin = (int) (sentinel - arena->free_list);
+    arena->bin_bitmap[bin / 64] &= ~((uint64_t) 1 << (bin % 64));
+  }
+#endif
+} /* free_list_remove() */
+
+/*
+ * Replace old_object on the free list by the free object at new_object (which
+ * may be the same object), now size bytes long, and write its header and
+ * footer. The list position is kept if the size stays within the same bin.
+ */
+
+static void free_list_move(struct arena *arena, object_header *old_object,
+                           object_header *new_object, size_t size) {
+  if (bin_index(get_object_size(old_object)) != bin_index(size)) {
+    free_list_remove(arena, old_object);
+    set_object_tags(new_object, size, UNALLOCATED);
+    free_list_insert(arena, new_object);
+    return;
+  }
+
+  if (in_size_tree(old_object)) {
+    arena->size_tree = size_tree_remove(arena->size_tree, old_object);
+  }
+
+  if (new_object != old_object) {
+    // Read the links first, since the two headers may overlap
+
+    object_header *next = old_object->next;
+    object_header *prev = old_object->prev;
+    new_object->next = next;
+    new_object->prev = prev;
+    next->prev = new_object;
+    prev->next = new_object;
+    if (arena->rover == old_object) {
+      arena->rover = new_object;
+    }
+  }
+  set_object_tags(new_object, size, UNALLOCATED);
+
+  if (in_size_tree(new_object)) {
+    arena->size_tree = size_tree_insert(arena->size_tree, new_object);
+  }
+} /* free_list_move() */
+
+/*
+ * Search the free list of bin of arena for an object of at least size bytes
+ * (header and footer included), as the fit policy says. Return NULL if there
+ * is none.
+ */
+
+static object_header *search_free_list(struct arena *arena, int bin,
+                                       size_t size) {
+  object_header *sentinel = &arena->free_list[bin];
+  object_header *start = sentinel->next;
+  if ((fit_policy == NEXT_FIT) && (arena->rover_bin == bin) &&
+      (arena->rover != NULL) &&
+      (get_object_status(arena->rover) != SENTINEL)) {
+    start = arena->rover;
+  }
+
+  // Next fit goes around the list once, from where the previous search
+  // stopped
+
+  object_header *best = NULL;
+  object_header *object = start;
+  int wrapped = 0;
+  uint64_t visited = 0;
+
+  for (;;) {
+    if (object == sentinel) {
+      if (wrapped || (start == sentinel->next)) {
+        break;
+      }
+      wrapped = 1;
+      object = sentinel->next;
+      continue;
+    }
+    if (wrapped && (object == start)) {
+      break;
+    }
+
+    visited++;
+    size_t object_size = get_object_size(object);
+    if (object_size >= size) {
+      if (fit_policy != BEST_FIT) {
+        best = object;
+        break;
+      }
+      if ((best == NULL) || (object_size < get_object_size(best))) {
+        best = object;
+        if (object_size == size) {
+          break;
+        }
+      }
+    }
+    object = object->next;
+  }
+
+  if (profiling) {
+    profile_record(PROFILE_SEARCH_NODES, visited);
+  }
+
+  if ((best != NULL) && (fit_policy == NEXT_FIT)) {
+    arena->rover = best;
+    arena->rover_bin = bin;
+  }
+  return best;
+} /* search_free_list() */
+
+/*
+ * Find a free object of at least size bytes (header and footer included).
+ * Return NULL if there is none.
+ */
+
+static object_header *find_free_object(struct arena *arena, size_t size) {
+  // Every free object large enough for a large request is in the size tree
+
+  if ((fit_policy == BEST_FIT) && (size >= SIZE_TREE_MIN)) {
+    return size_tree_find(arena, size);
+  }
+
+  // The bin for size may also hold objects that are too small,
+  // so search all of it.
+
+  int bin = bin_index(size);
+  object_header *object = search_free_list(arena, bin, size);
+  if (object != NULL) {
+    return object;
+  }
+
+#if MYMALLOC_SEGREGATED
+  // Every object in a later bin is large enough
+
+  bin = next_nonempty_bin(arena, bin + 1);
+  if (bin >= 0) {
+    return search_free_list(arena, bin, size);
+  }
+#endif
+
+  return NULL;
+} /* find_free_object() */
+
+/*
+ * Get a new chunk from the OS for arena, set up its fenceposts, and put the
+ * free object spanning the rest of it on the free list. Return that object,
+ * or NULL if the OS (or the arena's span) is out of memory.
+ */
+
+static object_header *add_os_chunk(struct arena *arena) {
+  size_t chunk_size = (arena->span != NULL) ? span_chunk_size : os_chunk_size;
+  void *new_block = get_memory_from_os(arena, chunk_size);
+  if (new_block == NULL) {
+    return NULL;
+  }
+
+  // Establish memory locations for objects within the new block.
+  // The free object gets everything between the fenceposts.
+
+  size_t free_size = chunk_size -
+                     sizeof(object_footer) -
+                     sizeof(object_header);
+
+  object_footer *start_fencepost = (object_footer *) new_block;
+  object_header *current_header =
+    (object_header *) ((char *) start_fencepost +
+                              sizeof(object_footer));
+  object_header *end_fencepost =
+    (object_header *) ((char *) current_header + free_size);
+
+  // Establish fenceposts
+  // We set fencepost size to 0 as an arbitrary value which would
+  // be impossible as a value for a valid memory block
+
+#if MYMALLOC_COMPACT_HEADERS
+  start_fencepost->object_size = 0;
+  current_header->object_size = PREV_ALLOCATED;
+#else
+  start_fencepost->status = ALLOCATED;
+  start_fencepost->object_size = 0;
+#endif
+
+  set_fencepost_tags(end_fencepost, ALLOCATED);
+  end_fencepost->next = (object_header *) start_fencepost;
+  end_fencepost->prev = arena->chunk_list;
+  arena->chunk_list = end_fencepost;
+
+  // A chunk from sbrk() that does not start on a page boundary shares its
+  // first page with whatever the break was lowered from, so clear the rest
+  // of that page before counting the chunk as fresh.
+
+  if (((uintptr_t) new_block & (page_size - 1)) != 0) {
+    char *usable = (char *) usable_memory_of(current_header);
+    char *page_end = (char *) (((uintptr_t) new_block + page_size) &
+                               ~(uintptr_t) (page_size - 1));
+    if (page_end > usable) {
+      memset(usable, 0, page_end - usable);
+    }
+  }
+
+  // Establish main free object
+
+  set_object_tags(current_header, free_size, UNALLOCATED);
+  free_list_insert(arena, current_header);
+
+  arena->fresh_start = (char *) current_header;
+  arena->fresh_end = (char *) end_fencepost;
+
+  return current_header;
+} /* add_os_chunk() */
+
+/*
+ * Return the size of the object needed to hold size bytes of usable memory,
+ * header and footer included.
+ */
+
+static size_t round_object_size(size_t size) {
+  if (size < MINIMUM_SIZE) {
+    size = MINIMUM_SIZE;
+  }
+
+  // Add the object_header/Footer to the size and round the total size
+  // up to a multiple of SIZE_PRECISION bytes for alignment.
+  // Bitwise-and with ~(SIZE_PRECISION - 1) will set the last x bits to 0,
+  // if SIZE_PRECISION = 2**x.
+
+  return (size +
+          OBJECT_OVERHEAD +
+          (SIZE_PRECISION - 1)) & ~(SIZE_PRECISION - 1);
+} /* round_object_size() */
+
+#if MYMALLOC_SLABS
+
+/*
+ * Return whether ptr points into a slab run.
+ */
+
+static inline int is_slab_object(void *ptr) {
+  return (uintptr_t) ((char *) ptr - slab_region) < SLAB_REGION_SIZE;
+} /* is_slab_object() */
+
+/*
+ * Return the slab run holding the object pointed by ptr.
+ */
+
+static inline struct slab_run *slab_run_of(void *ptr) {
+  return (struct slab_run *) ((uintptr_t) ptr &
+                              ~(uintptr_t) (SLAB_RUN_SIZE - 1));
+} /* slab_run_of() */
+
+/*
+ * Get an empty run of arena for objects of object_size bytes, reusing a
+ * released run if possible. Return NULL if the slab region is used up.
+ */
+
+static struct slab_run *new_slab_run(struct arena *arena, size_t object_size) {
+  struct slab_run *run = arena->free_runs;
+
+  if (run != NULL) {
+    arena->free_runs = run->next;
+  }
+  else {
+    // The region is shared by all arenas, so claim the run atomically
+
+    if (slab_region == NULL) {
+      return NULL;
+    }
+    run = (struct slab_run *) __atomic_fetch_add(&slab_region_used,
+                                                 SLAB_RUN_SIZE,
+                                                 __ATOMIC_RELAXED);
+    if ((char *) run + SLAB_RUN_SIZE > slab_region + SLAB_REGION_SIZE) {
+      __atomic_store_n(&slab_region_used, slab_region + SLAB_REGION_SIZE,
+                       __ATOMIC_RELAXED);
+      return NULL;
+    }
+  }
+
+  run->arena = arena;
+  run->free_objects = NULL;
+  run->unused = (char *) run + SLAB_RUN_HEADER_SIZE;
+  run->object_size = object_size;
+  run->num_allocated = 0;
+  return run;
+} /* new_slab_run() */
+
+/*
+ * Allocate an object of size bytes from a slab run of arena. Return NULL if
+ * no run can be had, in which case the free lists serve the request.
+ */
+
+static void *slab_allocate(struct arena *arena, size_t size) {
+  if (size < MINIMUM_SIZE) {
+    size = MINIMUM_SIZE;
+  }
+  int index = (int) ((size + (SIZE_PRECISION - 1)) / SIZE_PRECISION) - 1;
+  size_t object_size = (size_t) (index + 1) * SIZE_PRECISION;
+
+  struct slab_run *sentinel = &arena->slab_runs[index];
+  struct slab_run *run = sentinel->next;
+
+  if (run == sentinel) {
+    run = new_slab_run(arena, object_size);
+    if (run == NULL) {
+      return NULL;
+    }
+    run->next = sentinel->next;
+    run->prev = sentinel;
+    run->next->prev = run;
+    sentinel->next = run;
+  }
+
+  void *ptr = run->free_objects;
+  if (ptr != NULL) {
+    run->free_objects = *(void **) ptr;
+  }
+  else {
+    ptr = run->unused;
+    run->unused += object_size;
+  }
+  run->num_allocated++;
+
+  // Take full runs off the list
+
+  if ((run->free_objects == NULL) &&
+      (run->unused + object_size > (char *) run + SLAB_RUN_SIZE)) {
+    run->prev->next = run->next;
+    run->next->prev = run->prev;
+    run->next = NULL;
+  }
+
+  return ptr;
+} /* slab_allocate() */
+
+/*
+ * Free an object allocated by slab_allocate(). The mutex of the run's arena
+ * must be held. A run that becomes empty is released for reuse by any size
+ * class of the arena, unless it is the only run left with free objects of
+ * its class.
+ */
+
+static void slab_free(void *ptr) {
+  struct slab_run *run = slab_run_of(ptr);
+  struct arena *arena = run->arena;
+  int index = (int) (run->object_size / SIZE_PRECISION) - 1;
+  struct slab_run *sentinel = &arena->slab_runs[index];
+
+  *(void **) ptr = run->free_objects;
+  run->free_objects = ptr;
+  run->num_allocated--;
+
+  if (run->next == NULL) {
+    // The run was full, so put it back on its list
+
+    run->next = sentinel->next;
+    run->prev = sentinel;
+    run->next->prev = run;
+    sentinel->next = run;
+  }
+
+  if ((run->num_allocated == 0) &&
+      ((sentinel->next != run) || (run->next != sentinel))) {
+    run->prev->next = run->next;
+    run->next->prev = run->prev;
+
+    madvise((char *) run + page_size, SLAB_RUN_SIZE - page_size,
+            MADV_DONTNEED);
+    run->next = arena->free_runs;
+    arena->free_runs = run;
+  }
+} /* slab_free() */
+
+#endif // MYMALLOC_SLABS
+
+/*
+ * Allocate an object of size size in a mapping of its own, marked MAPPED in
+ * its header, with its usable memory aligned to alignment, a power of two.
+ * It is 16-byte aligned anyway. Return a pointer to the usable memory, or
+ * NULL if mmap() fails.
+ */
+
+static void *allocate_mapped_object(struct stat_shard *shard, size_t size,
+                                    size_t alignment) {
+  size_t overhead = MAPPED_HEADER_OFFSET + HEADER_SIZE;
+  if (alignment <= 16) {
+    alignment = 0;
+  }
+  if (size > (size_t) -1 - overhead - alignment - 2 * page_size) {
+    return NULL;
+  }
+
+  // Over-allocate by alignment, then unmap the pages on either side of the
+  // aligned object, keeping the page its header is in
+
+  size_t mapped_size = (size + overhead + alignment + (page_size - 1)) &
+                       ~(page_size - 1);
+
+  char *mapping = (char *) mmap(NULL, mapped_size, PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mapping == MAP_FAILED) {
+    return NULL;
+  }
+
+  object_header *object = (object_header *) (mapping + MAPPED_HEADER_OFFSET);
+  if (alignment != 0) {
+    uintptr_t usable = ((uintptr_t) mapping + overhead + (alignment - 1)) &
+                       ~(uintptr_t) (alignment - 1);
+    object = header_of((void *) usable);
+
+    char *start = mapping_of(object);
+    char *end = (char *) ((usable + size + (page_size - 1)) &
+                          ~(uintptr_t) (page_size - 1));
+    if (start > mapping) {
+      munmap(mapping, start - mapping);
+    }
+    if (end < mapping + mapped_size) {
+      munmap(end, mapping + mapped_size - end);
+    }
+    mapped_size = end - start;
+  }
+
+  set_mapped_tags(object, mapped_size);
+  shard_count(shard, STAT_MAPPED_OBJECTS, 1);
+
+  return usable_memory_of(object);
+} /* allocate_mapped_object() */
+
+/*
+ * Note that the object at object of arena was just allocated, moving the
+ * start of the fresh part of the newest chunk past it. Return whether its
+ * usable memory is all zero, which is the case if it was carved from that
+ * fresh part.
+ */
+
+static int take_fresh_object(struct arena *arena, object_header *object) {
+  char *start = (char *) object;
+  char *end = start + get_object_size(object);
+
+  if ((end <= arena->fresh_start) || (start >= arena->fresh_end)) {
+    return 0;
+  }
+
+  int fresh = (start >= arena->fresh_start);
+  arena->fresh_start = end;
+  if (!fresh) {
+    return 0;
+  }
+
+  // Clear what the free object kept in its usable memory: its trim stamp
+  // and size tree node, and with compact headers its links and footer as
+  // well
+
+  char *stamp = (char *) trim_stamp(object);
+  char *stamp_end = (char *) (size_node(object) + 1);
+  if (stamp_end > end - sizeof(object_footer)) {
+    stamp_end = end - sizeof(object_footer);
+  }
+  memset(stamp, 0, stamp_end - stamp);
+#if MYMALLOC_COMPACT_HEADERS
+  object_footer *footer = (object_footer *) (end - sizeof(object_footer));
+  object->next = NULL;
+  object->prev = NULL;
+  footer->object_size = 0;
+#endif
+
+  return 1;
+} /* take_fresh_object() */
+
+/*
+ * Free the allocated object at object of arena, whose mutex must be held,
+ * merging it with its free neighbours, and put the result on the free list.
+ */
+
+static void coalesce_object(struct arena *arena, object_header *object) {
+  size_t size = get_object_size(object);
+
+  // The boundary tags give us both neighbours in constant time.
+  // Fenceposts are marked ALLOCATED, so we never coalesce
+  // across the ends of an OS chunk.
+
+  object_header *next_header = (object_header *) ((char *) object + size);
+
+  if (prev_object_is_free(object)) {
+    // Merge left, and right as well if possible
+
+    object_footer *prev_footer =
+      (object_footer *) ((char *) object - sizeof(object_footer));
+    object_header *prev_header =
+      (object_header *) ((char *) object - prev_footer->object_size);
+    size += get_object_size(prev_header);
+    if (get_object_status(next_header) == UNALLOCATED) {
+      size += get_object_size(next_header);
+      free_list_remove(arena, next_header);
+      shard_count(arena->stat_shard, STAT_COALESCES, 1);
+    }
+    free_list_move(arena, prev_header, prev_header, size);
+    shard_count(arena->stat_shard, STAT_COALESCES, 1);
+  }
+  else if (get_object_status(next_header) == UNALLOCATED) {
+    // Merge right, taking over the right neighbour's place in the list
+
+    size += get_object_size(next_header);
+    free_list_move(arena, next_header, object, size);
+    shard_count(arena->stat_shard, STAT_COALESCES, 1);
+  }
+  else {
+    // Don't merge
+
+    set_object_tags(object, size, UNALLOCATED);
+    free_list_insert(arena, object);
+  }
+} /* coalesce_object() */
+
+#if MYMALLOC_QUICK_LISTS
+
+//
+// Quick lists
+//
+
+
+/*
+ * Coalesce every object on quick list index of arena, whose mutex must be
+ * held.
+ */
+
+static void quick_list_flush(struct arena *arena, int index) {
+  void *ptr = arena->quick_lists[index];
+  while (ptr != NULL) {
+    void *next = *(void **) ptr;
+    coalesce_object(arena, header_of(ptr));
+    ptr = next;
+  }
+  arena->quick_lists[index] = NULL;
+  arena->quick_counts[index] = 0;
+} /* quick_list_flush() */
+
+/*
+ * Put the allocated object at object, of at most QUICK_MAX_SIZE bytes, on
+ * the quick list for its size, flushing that list if it gets too long.
+ */
+
+static void quick_list_push(struct arena *arena, object_header *object) {
+  int index = (int) (get_object_size(object) / SIZE_PRECISION);
+  void *ptr = usable_memory_of(object);
+
+  *(void **) ptr = arena->quick_lists[index];
+  arena->quick_lists[index] = ptr;
+  if (++arena->quick_counts[index] > QUICK_LIST_MAX) {
+    quick_list_flush(arena, index);
+  }
+} /* quick_list_push() */
+
+/*
+ * Take an object of exactly size bytes off the quick lists of arena. Return
+ * NULL if there is none.
+ */
+
+static object_header *quick_list_pop(struct arena *arena, size_t size) {
+  if (size > QUICK_MAX_SIZE) {
+    return NULL;
+  }
+
+  int index = (int) (size / SIZE_PRECISION);
+  void *ptr = arena->quick_lists[index];
+  if (ptr == NULL) {
+    return NULL;
+  }
+
+  arena->quick_lists[index] = *(void **) ptr;
+  arena->quick_counts[index]--;
+  return header_of(ptr);
+} /* quick_list_pop() */
+
+/*
+ * Coalesce every object on the quick lists of arena, whose mutex must be
+ * held. Return whether there were any.
+ */
+
+static int quick_lists_flush_all(struct arena *arena) {
+  int flushed = 0;
+
+  for (int index = 0; index < NUM_QUICK_LISTS; index++) {
+    if (arena->quick_counts[index] > 0) {
+      quick_list_flush(arena, index);
+      flushed = 1;
+    }
+  }
+  return flushed;
+} /* quick_lists_flush_all() */
+
+#endif // MYMALLOC_QUICK_LISTS
+
+/*
+ * Allocate an object of size size in arena, whose mutex must be held.
+ * Ideally, we can allocate from the free list, but if we don't have a free
+ * object large enough, go get more memory from the OS. Return a pointer to
+ * the newly allocated memory.
+ *
+ * For calloc(), zeroed is not NULL: objects above CALLOC_MMAP_THRESHOLD then
+ * get a mapping of their own, and *zeroed tells whether the usable memory is
+ * known to be zero already.
+ */
+
+static void *allocate_zeroable_object(struct arena *arena, size_t size,
+                                      int *zeroed) {
+  size_t threshold = mmap_threshold;
+  if ((zeroed != NULL) && (threshold > CALLOC_MMAP_THRESHOLD)) {
+    threshold = CALLOC_MMAP_THRESHOLD;
+  }
+  int fresh = 0;
+  if (zeroed == NULL) {
+    zeroed = &fresh;
+  }
+  *zeroed = 0;
+
+#if MYMALLOC_REMOTE_FREES
+  remote_free_drain(arena);
+#endif
+
+  // Large objects never touch the free lists, and come zeroed
+
+  if (size > threshold) {
+    void *ptr = allocate_mapped_object(arena->stat_shard, size, 16);
+    *zeroed = (ptr != NULL);
+    return ptr;
+  }
+
+#if MYMALLOC_SLABS
+  // Neither do tiny ones, unless the slab region is used up
+
+  if (size <= SLAB_MAX_SIZE) {
+    void *ptr = slab_allocate(arena, size);
+    if (ptr != NULL) {
+      return ptr;
+    }
+  }
+#endif
+
+  size_t rounded_size = round_object_size(size);
+
+#if MYMALLOC_QUICK_LISTS
+  // Reuse a freed object of exactly that size as is
+
+  object_header *quick = quick_list_pop(arena, rounded_size);
+  if (quick != NULL) {
+    return usable_memory_of(quick);
+  }
+#endif
+
+  object_header *object = find_free_object(arena, rounded_size);
+#if MYMALLOC_QUICK_LISTS
+  if ((object == NULL) && quick_lists_flush_all(arena)) {
+    object = find_free_object(arena, rounded_size);
+  }
+#endif
+  if (object == NULL) {
+    // No free object is large enough, so get a new chunk from the OS.
+
+    if (add_os_chunk(arena) == NULL) {
+      return NULL;
+    }
+    object = find_free_object(arena, rounded_size);
+    if (object == NULL) {
+      return NULL;
+    }
+  }
+
+  if (get_object_size(object) >= rounded_size + MIN_OBJECT_SIZE) {
+    // Split: allocate the front of the object and leave the remainder
+    // on the free list.
+
+    object_header *remainder =
+      (object_header *) ((char *) object + rounded_size);
+    free_list_move(arena, object, remainder,
+                   get_object_size(object) - rounded_size);
+    set_object_tags(object, rounded_size, ALLOCATED);
+    shard_count(arena->stat_shard, STAT_SPLITS, 1);
+  }
+  else {
+    // The remainder would be too small to hold an object,
+    // so allocate the whole free object.
+
+    free_list_remove(arena, object);
+    set_object_tags(object, get_object_size(object), ALLOCATED);
+  }
+  *zeroed = take_fresh_object(arena, object);
+
+  // Return a pointer to usable memory
+
+  return usable_memory_of(object);
+} /* allocate_zeroable_object() */
+
+/*
+ * Allocate an object of size size in arena, whose mutex must be held. See
+ * allocate_zeroable_object().
+ */
+
+void *allocate_object(struct arena *arena, size_t size) {
+  return allocate_zeroable_object(arena, size, NULL);
+} /* allocate_object() */
+
+/*
+ * Allocate n objects of size size in arena, whose mutex must be held, and
+ * store pointers to their usable memory in out. Rather than search and
+ * split once per object, each free object found is carved into as many
+ * objects as it holds, and split once. Return the number of objects
+ * allocated, which is less than n only if out of memory.
+ */
+
+static size_t allocate_objects(struct arena *arena, size_t size, size_t n,
+                               void **out) {
+  size_t done = 0;
+
+#if MYMALLOC_REMOTE_FREES
+  remote_free_drain(arena);
+#endif
+
+  // Mapped and slab objects don't come from free objects, so there is
+  // nothing to carve
+
+  int carve = (size <= mmap_threshold);
+#if MYMALLOC_SLABS
+  carve = carve && (size > SLAB_MAX_SIZE);
+#endif
+  if (!carve) {
+    while (done < n) {
+      void *ptr = allocate_zeroable_object(arena, size, NULL);
+      if (ptr == NULL) {
+        break;
+      }
+      out[done++] = ptr;
+    }
+    return done;
+  }
+
+  size_t rounded_size = round_object_size(size);
+
+#if MYMALLOC_QUICK_LISTS
+  while (done < n) {
+    object_header *quick = quick_list_pop(arena, rounded_size);
+    if (quick == NULL) {
+      break;
+    }
+    out[done++] = usable_memory_of(quick);
+  }
+#endif
+
+  int added_chunk = 0;
+  while (done < n) {
+    // Look for a free object large enough for all the objects left, if a
+    // chunk could hold them, and settle for one large enough for one
+
+    size_t left = n - done;
+    object_header *object = NULL;
+    if ((left > 1) && (left <= os_chunk_size / rounded_size)) {
+      object = find_free_object(arena, left * rounded_size);
+    }
+    if (object == NULL) {
+      object = find_free_object(arena, rounded_size);
+    }
+    if (object == NULL) {
+#if MYMALLOC_QUICK_LISTS
+      if (quick_lists_flush_all(arena)) {
+        continue;
+      }
+#endif
+      if (added_chunk || (add_os_chunk(arena) == NULL)) {
+        break;
+      }
+      added_chunk = 1;
+      continue;
+    }
+    added_chunk = 0;
+
+    size_t total_size = get_object_size(object);
+    size_t num_objects = total_size / rounded_size;
+    if (num_objects > left) {
+      num_objects = left;
+    }
+    size_t rest = total_size - (num_objects * rounded_size);
+
+    if (rest >= MIN_OBJECT_SIZE) {
+      // Leave the tail on the free list
+
+      object_header *remainder =
+        (object_header *) ((char *) object + (num_objects * rounded_size));
+      free_list_move(arena, object, remainder, rest);
+      shard_count(arena->stat_shard, STAT_SPLITS, 1);
+      rest = 0;
+    }
+    else {
+      // The last object takes the tail, too small to hold an object
+
+      free_list_remove(arena, object);
+    }
+
+    // Write the objects in address order, so that with compact headers each
+    // gets its flag from the one before it
+
+    object_header *last = object;
+    for (size_t i = 0; i < num_objects; i++) {
+      size_t this_size = rounded_size;
+      if (i == num_objects - 1) {
+        this_size += rest;
+      }
+      last = object;
+      set_object_tags(object, this_size, ALLOCATED);
+      out[done++] = usable_memory_of(object);
+      object = (object_header *) ((char *) object + this_size);
+    }
+    take_fresh_object(arena, last);
+  }
+
+  return done;
+} /* allocate_objects() */
+
+/*
+ * Allocate an object of size size in arena, whose mutex must be held, with
+ * its usable memory aligned to alignment, a power of two. The object is
+ * carved out of a free object large enough for any misalignment, and the
+ * slack before it goes back on the free list as a free object of its own.
+ * Return a pointer to the usable memory, or NULL if out of memory.
+ */
+
+void *allocate_aligned_object(struct arena *arena, size_t alignment,
+                              size_t size) {
+  if (alignment <= SIZE_PRECISION) {
+    return allocate_object(arena, size);
+  }
+
+#if MYMALLOC_REMOTE_FREES
+  remote_free_drain(arena);
+#endif
+
+  // The slack before the object must be large enough to be a free object
+
+  size_t rounded_size = round_object_size(size);
+  size_t search_size = rounded_size + alignment + MIN_OBJECT_SIZE;
+  if ((size > mmap_threshold) || (search_size > mmap_threshold)) {
+    return allocate_mapped_object(arena->stat_shard, size, alignment);
+  }
+
+  object_header *candidate = find_free_object(arena, search_size);
+#if MYMALLOC_QUICK_LISTS
+  if ((candidate == NULL) && quick_lists_flush_all(arena)) {
+    candidate = find_free_object(arena, search_size);
+  }
+#endif
+  if (candidate == NULL) {
+    if (add_os_chunk(arena) == NULL) {
+      return NULL;
+    }
+    candidate = find_free_object(arena, search_size);
+    if (candidate == NULL) {
+      return allocate_mapped_object(arena->stat_shard, size, alignment);
+    }
+  }
+
+  uintptr_t usable = (uintptr_t) usable_memory_of(candidate);
+  uintptr_t aligned = usable;
+  if ((aligned & (alignment - 1)) != 0) {
+    aligned = (usable + MIN_OBJECT_SIZE + (alignment - 1)) &
+              ~(uintptr_t) (alignment - 1);
+  }
+
+  size_t total_size = get_object_size(candidate);
+  object_header *object = candidate;
+  if (aligned != usable) {
+    // Shrink the free object to the slack, and start the object after it
+
+    size_t slack = aligned - usable;
+    object = (object_header *) ((char *) candidate + slack);
+    total_size -= slack;
+    free_list_move(arena, candidate, candidate, slack);
+#if MYMALLOC_COMPACT_HEADERS
+    object->object_size = 0;
+#endif
+    shard_count(arena->stat_shard, STAT_SPLITS, 1);
+  }
+  else {
+    free_list_remove(arena, candidate);
+  }
+
+  if (total_size >= rounded_size + MIN_OBJECT_SIZE) {
+    // Put the tail back on the free list as well
+
+    object_header *remainder =
+      (object_header *) ((char *) object + rounded_size);
+    set_object_tags(remainder, total_size - rounded_size, UNALLOCATED);
+    free_list_insert(arena, remainder);
+    set_object_tags(object, rounded_size, ALLOCATED);
+    shard_count(arena->stat_shard, STAT_SPLITS, 1);
+  }
+  else {
+    set_object_tags(object, total_size, ALLOCATED);
+  }
+  take_fresh_object(arena, object);
+
+  return usable_memory_of(object);
+} /* allocate_aligned_object() */
+
+/*
+ * Note that frees objects were just freed in arena, whose mutex must be
+ * held, and run a trim pass every trim_interval frees.
+ */
+
+static void count_trim_frees(struct arena *arena, size_t frees) {
+  if (trim_interval <= 0) {
+    return;
+  }
+
+  if (frees >= (size_t) (trim_interval - arena->frees_since_trim)) {
+    arena->frees_since_trim = 0;
+    trim_heap(arena, 0, 1);
+  }
+  else {
+    arena->frees_since_trim += (int) frees;
+  }
+} /* count_trim_frees() */
+
+/*
+ * Free an object of arena, whose mutex must be held. ptr is a pointer to the
+ * usable block of memory in the object. If possible, coalesce the object,
+ * then add to the free list, or leave a small object on a quick list with
+ * MYMALLOC_QUICK_LISTS.
+ */
+
+void free_object(struct arena *arena, void *ptr) {
+#if MYMALLOC_SLABS
+  if (is_slab_object(ptr)) {
+    slab_free(ptr);
+    return;
+  }
+#endif
+
+  object_header *object = header_of(ptr);
+  size_t size = get_object_size(object);
+
+  if (get_object_status(object) == MAPPED) {
+    // The object has a mapping of its own, so give it back to the OS
+
+    munmap(mapping_of(object), size);
+    return;
+  }
+
+#if MYMALLOC_QUICK_LISTS
+  if (size <= QUICK_MAX_SIZE) {
+    quick_list_push(arena, object);
+    return;
+  }
+#endif
+
+  coalesce_object(arena, object);
+  count_trim_frees(arena, 1);
+} /* free_object() */
+
+/*
+ * Free the n objects of arena, whose mutex must be held, pointed by ptrs,
+ * which is sorted by address. Runs of objects next to each other are
+ * merged into one object first, so that each run is coalesced with its
+ * neighbours and put on the free list only once.
+ */
+
+static void free_objects(struct arena *arena, void **ptrs, size_t n) {
+  size_t i = 0;
+
+  while (i < n) {
+    object_header *first = header_of(ptrs[i]);
+    size_t run_size = 0;
+    size_t j = i;
+
+#if MYMALLOC_SLABS
+    if (!is_slab_object(ptrs[i]))
+#endif
+    {
+      while ((j < n) &&
+             (header_of(ptrs[j]) ==
+              (object_header *) ((char *) first + run_size)) &&
+             (get_object_status(header_of(ptrs[j])) == ALLOCATED)) {
+        run_size += get_object_size(header_of(ptrs[j]));
+        j++;
+      }
+    }
+
+    if (j - i <= 1) {
+      // Mapped, slab, and lone objects take the usual way
+
+      free_object(arena, ptrs[i]);
+      i++;
+      continue;
+    }
+
+    set_object_tags(first, run_size, ALLOCATED);
+    coalesce_object(arena, first);
+    count_trim_frees(arena, j - i);
+    i = j;
+  }
+} /* free_objects() */
+
+#if MYMALLOC_REMOTE_FREES
+
+/*
+ * Push the object pointed by ptr on the remote free stack of arena. Does
+ * not need the mutex.
+ */
+
+static void remote_free_push(struct arena *arena, void *ptr) {
+  void *head = __atomic_load_n(&arena->remote_frees, __ATOMIC_RELAXED);
+  do {
+    *(void **) ptr = head;
+  } while (!__atomic_compare_exchange_n(&arena->remote_frees, &head, ptr, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+} /* remote_free_push() */
+
+/*
+ * Free every object on the remote free stack of arena. The mutex of the
+ * arena must be held.
+ */
+
+static void remote_free_drain(struct arena *arena) {
+  if (__atomic_load_n(&arena->remote_frees, __ATOMIC_RELAXED) == NULL) {
+    return;
+  }
+
+  void *ptr = __atomic_exchange_n(&arena->remote_frees, NULL,
+                                  __ATOMIC_ACQUIRE);
+  while (ptr != NULL) {
+    void *next = *(void **) ptr;
+    free_object(arena, ptr);
+    ptr = next;
+  }
+} /* remote_free_drain() */
+
+#endif // MYMALLOC_REMOTE_FREES
+
+/*
+ * Give every OS chunk of arena that is entirely free back to the OS, as far
+ * as the backend allows (see return_memory_to_os()). Return the number of
+ * bytes released.
+ */
+
+static size_t release_free_chunks(struct arena *arena) {
+  size_t released = 0;
+  object_header **link = &arena->chunk_list;
+
+  // Walk newest first, so that with sbrk() each released chunk
+  // uncovers the next one at the top of the heap.
+
+  while (*link != NULL) {
+    object_header *end_fencepost = *link;
+    void *chunk = (void *) end_fencepost->next;
+    size_t size = (size_t) ((char *) (end_fencepost + 1) - (char *) chunk);
+
+    // The chunk is free if a single free object spans it from fencepost
+    // to fencepost.
+
+    object_header *object =
+      (object_header *) ((char *) chunk + sizeof(object_footer));
+    if ((get_object_status(object) != UNALLOCATED) ||
+        ((char *) object + get_object_size(object) !=
+         (char *) end_fencepost) ||
+        !can_return_memory_to_os(arena, chunk, size)) {
+      link = &end_fencepost->prev;
+      continue;
+    }
+
+    free_list_remove(arena, object);
+    *link = end_fencepost->prev;
+    return_memory_to_os(arena, chunk, size);
+    released += size;
+  }
+
+  return released;
+} /* release_free_chunks() */
+
+/*
+ * Give the whole pages inside the free object at object back to the OS,
+ * keeping its header, footer, trim stamp, and size tree node. Return the
+ * number of bytes released.
+ */
+
+static size_t release_free_object(object_header *object) {
+  uintptr_t start = (uintptr_t) (size_node(object) + 1);
+  uintptr_t end = (uintptr_t) object + get_object_size(object) -
+                  sizeof(object_footer);
+
+  start = (start + (page_size - 1)) & ~(uintptr_t) (page_size - 1);
+  end &= ~(uintptr_t) (page_size - 1);
+  if (end <= start) {
+    return 0;
+  }
+
+  madvise((void *) start, end - start, MADV_DONTNEED);
+  return end - start;
+} /* release_free_object() */
+
+/*
+ * Return memory of arena to the OS: release the entirely free chunks (unless
+ * pad is non-zero, in which case they are kept), then the interior
+ * pages of free objects. With idle_only, only objects of at least
+ * TRIM_SPAN_THRESHOLD bytes that have stayed free since the previous pass are
+ * released. Each pass stamps the free objects it sees, so that the next pass
+ * can tell which ones stayed free and which are already released.
+ * Return the number of bytes released. The mutex of the arena must be held.
+ */
+
+static size_t trim_heap(struct arena *arena, size_t pad, int idle_only) {
+#define TRIM_STAMP(epoch, released) (((epoch) << 1) | (released))
+
+  size_t released = (pad == 0) ? release_free_chunks(arena) : 0;
+  size_t min_size = idle_only ? TRIM_SPAN_THRESHOLD : page_size;
+  size_t trim_epoch = ++arena->trim_epoch;
+
+  for (int bin = 0; bin < NUM_BINS; bin++) {
+    object_header *sentinel = &arena->free_list[bin];
+    for (object_header *object = sentinel->next; object != sentinel;
+         object = object->next) {
+      if (get_object_size(object) < min_size) {
+        continue;
+      }
+
+      size_t *stamp = trim_stamp(object);
+      if (*stamp == TRIM_STAMP(trim_epoch - 1, 1)) {
+        // Released by the previous pass and untouched since
+
+        *stamp = TRIM_STAMP(trim_epoch, 1);
+      }
+      else if (idle_only && (*stamp != TRIM_STAMP(trim_epoch - 1, 0))) {
+        // Not seen by the previous pass, so not idle yet
+
+        *stamp = TRIM_STAMP(trim_epoch, 0);
+      }
+      else {
+        released += release_free_object(object);
+        *stamp = TRIM_STAMP(trim_epoch, 1);
+      }
+    }
+  }
+
+  return released;
+} /* trim_heap() */
+
+/*
+ * Resize the object pointed by ptr to hold size bytes without moving its
+ * contents, if possible: shrink by splitting off the tail onto the free list,
+ * grow by absorbing a free right neighbour, or grow or shrink a mapped object
+ * with mremap(). Return the (possibly moved, for mremap()) pointer, or NULL if
+ * the caller has to allocate a new object and copy. The mutex of arena, the
+ * arena owning the object, must be held.
+ */
+
+void *reallocate_object(struct arena *arena, void *ptr, size_t size) {
+#if MYMALLOC_SLABS
+  if (is_slab_object(ptr)) {
+    // Keep the object if the size still fits its class
+
+    return (size <= slab_run_of(ptr)->object_size) ? ptr : NULL;
+  }
+#endif
+
+  object_header *object = header_of(ptr);
+
+  if (get_object_status(object) == MAPPED) {
+    if (size <= mmap_threshold) {
+      return NULL;
+    }
+
+    size_t offset = (char *) object - mapping_of(object);
+    size_t mapped_size = (size + offset + HEADER_SIZE +
+                          (page_size - 1)) & ~(page_size - 1);
+    if (mapped_size < size) {
+      return NULL;
+    }
+
+    if (mapped_size != get_object_size(object)) {
+      char *mapping = (char *) mremap(mapping_of(object),
+                                      get_object_size(object), mapped_size,
+                                      MREMAP_MAYMOVE);
+      if (mapping == MAP_FAILED) {
+        return NULL;
+      }
+      object = (object_header *) (mapping + offset);
+      set_mapped_tags(object, mapped_size);
+    }
+    return usable_memory_of(object);
+  }
+
+  if (size > mmap_threshold) {
+    return NULL;
+  }
+
+  size_t rounded_size = round_object_size(size);
+  size_t current_size = get_object_size(object);
+
+  if (current_size >= rounded_size) {
+    // Shrink, giving the tail back if it is large enough to be an object.
+    // free_object() coalesces it with a free right neighbour.
+
+    if (current_size >= rounded_size + MIN_OBJECT_SIZE) {
+      object_header *tail =
+        (object_header *) ((char *) object + rounded_size);
+      set_object_tags(tail, current_size - rounded_size, ALLOCATED);
+      set_object_tags(object, rounded_size, ALLOCATED);
+      shard_count(arena->stat_shard, STAT_SPLITS, 1);
+      free_object(arena, usable_memory_of(tail));
+    }
+    return ptr;
+  }
+
+  object_header *next_header =
+    (object_header *) ((char *) object + current_size);
+  if ((get_object_status(next_header) != UNALLOCATED) ||
+      (current_size + get_object_size(next_header) < rounded_size)) {
+    return NULL;
+  }
+
+  // Grow into the free right neighbour, leaving whatever is not needed
+  // in its place on the free list.
+
+  size_t total_size = current_size + get_object_size(next_header);
+  if (total_size >= rounded_size + MIN_OBJECT_SIZE) {
+    object_header *remainder =
+      (object_header *) ((char *) object + rounded_size);
+    free_list_move(arena, next_header, remainder, total_size - rounded_size);
+    set_object_tags(object, rounded_size, ALLOCATED);
+    shard_count(arena->stat_shard, STAT_SPLITS, 1);
+  }
+  else {
+    free_list_remove(arena, next_header);
+    set_object_tags(object, total_size, ALLOCATED);
+  }
+  take_fresh_object(arena, object);
+  return ptr;
+} /* reallocate_object() */
+
+/*
+ * Return the number of usable bytes in the object pointed by ptr,
+ * which excludes its header and footer.
+ */
+
+static size_t usable_size(void *ptr) {
+#if MYMALLOC_SLABS
+  if (is_slab_object(ptr)) {
+    return slab_run_of(ptr)->object_size;
+  }
+#endif
+
+  object_header *object = header_of(ptr);
+
+  if (get_object_status(object) == MAPPED) {
+    return mapping_of(object) + get_object_size(object) - (char *) ptr;
+  }
+  return get_object_size(object) - OBJECT_OVERHEAD;
+} /* usable_size() */
+
+/*
+ * Return the size of the object pointed by ptr. We assume that ptr points 
+ * usable memory in a valid obejct.
+ */
+
+size_t object_size(void *ptr) {
+#if MYMALLOC_SLABS
+  // Slab objects have no header
+
+  if (is_slab_object(ptr)) {
+    return slab_run_of(ptr)->object_size;
+  }
+#endif
+
+  // ptr will point at the end of the header, so subtract the size of the
+  // header to get the start of the header.
+
+  object_header *object = header_of(ptr);
+
+  return get_object_size(object);
+} /* object_size() */
+
+/*
+ * Print statistics on heap size and
+ * how many times each function has been called.
+ */
+
+void print_stats() {
+  struct mymalloc_stats stats;
+  mymalloc_stats(&stats);
+
+  printf("\n-------------------\n");
+
+  printf("HeapSize:\t%zd bytes\n", stats.heap_size);
+  printf("# mallocs:\t%llu\n", stats.malloc_calls);
+  printf("# reallocs:\t%llu\n", stats.realloc_calls);
+  printf("# callocs:\t%llu\n", stats.calloc_calls);
+  printf("# frees:\t%llu\n", stats.free_calls);
+
+  printf("\n-------------------\n");
+} /* print_stats() */
+
+/*
+ * Fill in stats with the current statistics of the allocator. The counters
+ * are read without stopping other threads, so they are only consistent
+ * with each other once the program is quiet.
+ */
+
+void mymalloc_stats(struct mymalloc_stats *stats) {
+  unsigned long long totals[NUM_STAT_COUNTERS] = { 0 };
+
+  for (int shard = 0; shard < NUM_STAT_SHARDS; shard++) {
+    for (int i = 0; i < NUM_STAT_COUNTERS; i++) {
+      totals[i] += __atomic_load_n(&stat_shards[shard].counters[i],
+                                   __ATOMIC_RELAXED);
+    }
+  }
+
+  stats->malloc_calls = totals[STAT_MALLOC_CALLS];
+  stats->free_calls = totals[STAT_FREE_CALLS];
+  stats->realloc_calls = totals[STAT_REALLOC_CALLS];
+  stats->calloc_calls = totals[STAT_CALLOC_CALLS];
+  stats->bytes_allocated = totals[STAT_BYTES_ALLOCATED];
+  stats->bytes_freed = totals[STAT_BYTES_FREED];
+  stats->live_bytes = totals[STAT_BYTES_ALLOCATED] - totals[STAT_BYTES_FREED];
+  for (int i = 0; i < MYMALLOC_STAT_CLASSES; i++) {
+    stats->size_class_requests[i] = totals[STAT_SIZE_CLASSES + i];
+  }
+  stats->lock_contentions = totals[STAT_LOCK_CONTENTIONS];
+  stats->os_chunk_requests = totals[STAT_OS_CHUNK_REQUESTS];
+  stats->os_chunk_releases = totals[STAT_OS_CHUNK_RELEASES];
+  stats->mapped_objects = totals[STAT_MAPPED_OBJECTS];
+  stats->splits = totals[STAT_SPLITS];
+  stats->coalesces = totals[STAT_COALESCES];
+
+  stats->heap_size = 0;
+  for (int i = 0; i < num_arenas; i++) {
+    stats->heap_size += __atomic_load_n(&arenas[i].heap_size,
+                                        __ATOMIC_RELAXED);
+  }
+  stats->pool_size = __atomic_load_n(&pool_size, __ATOMIC_RELAXED);
+} /* mymalloc_stats() */
+
+/*
+ * Write the current statistics of the allocator to buffer as a JSON object
+ * of at most size bytes, terminator included. Return the length of the
+ * whole object, like snprintf(3): if it is size or more, the object was
+ * truncated.
+ */
+
+int mymalloc_stats_json(char *buffer, size_t size) {
+  struct mymalloc_stats stats;
+  mymalloc_stats(&stats);
+
+  // Append with snprintf(), tracking the full length even once the buffer
+  // is full
+
+  size_t length = 0;
+#define APPEND(...) \
+  length += (size_t) snprintf(buffer + ((length < size) ? length : size), \
+                              (length < size) ? size - length : 0, \
+                              __VA_ARGS__)
+
+  APPEND("{\"malloc_calls\":%llu,\"free_calls\":%llu,"
+         "\"realloc_calls\":%llu,\"calloc_calls\":%llu,",
+         stats.malloc_calls, stats.free_calls, stats.realloc_calls,
+         stats.calloc_calls);
+  APPEND("\"bytes_allocated\":%llu,\"bytes_freed\":%llu,"
+         "\"live_bytes\":%llu,",
+         stats.bytes_allocated, stats.bytes_freed, stats.live_bytes);
+  APPEND("\"size_class_requests\":[");
+  for (int i = 0; i < MYMALLOC_STAT_CLASSES; i++) {
+    APPEND("%s%llu", (i > 0) ? "," : "", stats.size_class_requests[i]);
+  }
+  APPEND("],\"lock_contentions\":%llu,\"os_chunk_requests\":%llu,"
+         "\"os_chunk_releases\":%llu,\"mapped_objects\":%llu,",
+         stats.lock_contentions, stats.os_chunk_requests,
+         stats.os_chunk_releases, stats.mapped_objects);
+  APPEND("\"splits\":%llu,\"coalesces\":%llu,\"heap_size\":%zu,"
+         "\"pool_size\":%zu}",
+         stats.splits, stats.coalesces, stats.heap_size, stats.pool_size);
+
+#undef APPEND
+  return (int) length;
+} /* mymalloc_stats_json() */
+
+/*
+ * Return the smallest value above every value counted up to the bucket
+ * holding the given fraction of the values counted in buckets.
+ */
+
+static unsigned long long profile_percentile(unsigned long long *buckets,
+                                             unsigned long long total,
+                                             double fraction) {
+  unsigned long long seen = 0;
+
+  for (int bucket = 0; bucket < PROFILE_BUCKETS; bucket++) {
+    seen += buckets[bucket];
+    if ((seen > 0) && (seen >= fraction * total)) {
+      return (bucket == 64) ? ~0ULL : (1ULL << bucket);
+    }
+  }
+  return 0;
+} /* profile_percentile() */
+
+/*
+ * Write the length bytes of buffer to stderr, going on after short writes
+ * and interrupts. Give up on any other error: there is nowhere to report
+ * it. Safe in a signal handler.
+ */
+
+static void write_stderr(const char *buffer, int length) {
+  int saved_errno = errno;
+
+  while (length > 0) {
+    ssize_t written = write(2, buffer, (size_t) length);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    buffer += written;
+    length -= (int) written;
+  }
+
+  errno = saved_errno;
+} /* write_stderr() */
+
+/*
+ * Print the profiling histograms to stderr. This only uses write(2) and a
+ * static buffer, so it can run from the MALLOCPROFILESIGNAL handler even
+ * while the allocator is in use, but two dumps must not overlap.
+ */
+
+void print_profile() {
+  static const char *names[NUM_PROFILE_HISTOGRAMS] = {
+    "malloc cycles",
+    "free cycles",
+    "realloc cycles",
+    "calloc cycles",
+    "lock wait cycles",
+    "lock hold cycles",
+    "free list nodes visited",
+  };
+  static char buffer[256];
+
+  for (int histogram = 0; histogram < NUM_PROFILE_HISTOGRAMS; histogram++) {
+    unsigned long long buckets[PROFILE_BUCKETS] = { 0 };
+    unsigned long long total = 0;
+
+    for (int shard = 0; shard < NUM_STAT_SHARDS; shard++) {
+      for (int bucket = 0; bucket < PROFILE_BUCKETS; bucket++) {
+        buckets[bucket] += __atomic_load_n(
+          &profile_shards[shard].buckets[histogram][bucket], __ATOMIC_RELAXED);
+      }
+    }
+    for (int bucket = 0; bucket < PROFILE_BUCKETS; bucket++) {
+      total += buckets[bucket];
+    }
+    if (total == 0) {
+      continue;
+    }
+
+    int length = snprintf(buffer, sizeof(buffer),
+                          "%s: %llu, p50 < %llu, p90 < %llu, p99 < %llu, "
+                          "max < %llu\n", names[histogram], total,
+                          profile_percentile(buckets, total, 0.5),
+                          profile_percentile(buckets, total, 0.9),
+                          profile_percentile(buckets, total, 0.99),
+                          profile_percentile(buckets, total, 1.0));
+    write_stderr(buffer, (length < (int) sizeof(buffer)) ?
+                         length : (int) sizeof(buffer) - 1);
+
+    for (int bucket = 0; bucket < PROFILE_BUCKETS; bucket++) {
+      if (buckets[bucket] == 0) {
+        continue;
+      }
+      length = snprintf(buffer, sizeof(buffer), "  [%llu, %llu): %llu\n",
+                        (bucket == 0) ? 0ULL : (1ULL << (bucket - 1)),
+                        (bucket == 64) ? ~0ULL : (1ULL << bucket),
+                        buckets[bucket]);
+      write_stderr(buffer, (length < (int) sizeof(buffer)) ?
+                           length : (int) sizeof(buffer) - 1);
+    }
+  }
+} /* print_profile() */
+
+/*
+ * Dump the profile on the signal given by MALLOCPROFILESIGNAL.
+ */
+
+static void profile_signal_handler(int signum) {
+  (void) signum;
+  print_profile();
+} /* profile_signal_handler() */
+
+/*
+ * Print a representation of the current free list.
+ * For each object in the free list, show the offset (distance in memory from
+ * the start of the memory pool, mem_start) and the size of the object.
+ * The free lists of all arenas are printed one after the other.
+ */
+
+void print_list() {
+  printf("FreeList: ");
+
+  int first = 1;
+  for (int i = 0; i < num_arenas; i++) {
+    struct arena *arena = &arenas[i];
+    lock_arena_mutex(arena);
+
+#if MYMALLOC_REMOTE_FREES
+    remote_free_drain(arena);
+#endif
+#if MYMALLOC_QUICK_LISTS
+    quick_lists_flush_all(arena);
+#endif
+
+    for (int bin = 0; bin < NUM_BINS; bin++) {
+      object_header *sentinel = &arena->free_list[bin];
+      object_header *ptr = sentinel->next;
+
+      while (ptr != sentinel) {
+        if (!first) {
+          printf("->");
+        }
+        first = 0;
+
+        long offset = (long) ptr - (long) mem_start;
+        printf("[offset:%ld,size:%zd]", offset, get_object_size(ptr));
+        ptr = ptr->next;
+      }
+    }
+
+    unlock_arena_mutex(arena);
+  }
+  printf("\n");
+} /* print_list() */
+
+//
+// Heap introspection
+//
+
+
+/*
+ * Fill in info with the shape of the heap. Each arena is locked only while
+ * its free lists are walked.
+ */
+
+void mymalloc_heap_info(struct mymalloc_heap_info *info) {
+  memset(info, 0, sizeof(*info));
+  info->num_arenas = num_arenas;
+  info->pool_size = __atomic_load_n(&pool_size, __ATOMIC_RELAXED);
+
+  for (int i = 0; i < num_arenas; i++) {
+    struct arena *arena = &arenas[i];
+    struct mymalloc_arena_info *arena_info = &info->arenas[i];
+    lock_arena_mutex(arena);
+
+#if MYMALLOC_REMOTE_FREES
+    remote_free_drain(arena);
+#endif
+
+    arena_info->heap_size = arena->heap_size;
+    for (object_header *end_fencepost = arena->chunk_list;
+         end_fencepost != NULL; end_fencepost = end_fencepost->prev) {
+      arena_info->num_chunks++;
+    }
+
+    for (int bin = 0; bin < NUM_BINS; bin++) {
+      object_header *sentinel = &arena->free_list[bin];
+      for (object_header *object = sentinel->next; object != sentinel;
+           object = object->next) {
+        size_t size = get_object_size(object);
+        int bucket = (int) (sizeof(unsigned long) * 8) - 1 -
+                     __builtin_clzl((unsigned long) size);
+
+        arena_info->free_objects++;
+        arena_info->free_bytes += size;
+        if (size > arena_info->largest_free) {
+          arena_info->largest_free = size;
+        }
+        info->free_size_histogram[(bucket < MYMALLOC_HEAP_BUCKETS) ?
+                                  bucket : MYMALLOC_HEAP_BUCKETS - 1]++;
+      }
+    }
+
+    unlock_arena_mutex(arena);
+
+    if (arena_info->heap_size > 0) {
+      arena_info->utilization =
+        1.0 - ((double) arena_info->free_bytes /
+               (double) arena_info->heap_size);
+    }
+    info->heap_size += arena_info->heap_size;
+    info->free_bytes += arena_info->free_bytes;
+    info->free_objects += arena_info->free_objects;
+    if (arena_info->largest_free > info->largest_free) {
+      info->largest_free = arena_info->largest_free;
+    }
+  }
+
+  if (info->free_bytes > 0) {
+    info->fragmentation = 1.0 - ((double) info->largest_free /
+                                 (double) info->free_bytes);
+  }
+  if (info->heap_size > 0) {
+    info->utilization = 1.0 - ((double) info->free_bytes /
+                                (double) info->heap_size);
+  }
+} /* mymalloc_heap_info() */
+
+// The occupancy map has one cell per MAP_CELL_SIZE bytes of an OS chunk,
+// MAP_COLUMNS cells to a row, and is drawn from a snapshot: for each chunk,
+// a struct map_chunk followed by the bytes in use in each cell.
+
+#define MAP_CELL_SIZE ((size_t) 4096)
+#define MAP_COLUMNS (64)
+#define MAP_SVG_CELL (8)
+#define MAP_SVG_LABEL (16)
+
+struct map_chunk {
+  char *start;
+  size_t size;
+  size_t num_cells;
+};
+
+/*
+ * Return the bytes a snapshot takes for a chunk of size bytes.
+ */
+
+static inline size_t map_chunk_bytes(size_t size) {
+  size_t num_cells = (size + (MAP_CELL_SIZE - 1)) / MAP_CELL_SIZE;
+  return (sizeof(struct map_chunk) + (num_cells * sizeof(uint16_t)) + 7) &
+         ~(size_t) 7;
+} /* map_chunk_bytes() */
+
+/*
+ * Return the bytes a snapshot of the chunks of arena, whose mutex must be
+ * held, takes. Chunks may differ in size, so they are all walked.
+ */
+
+static size_t heap_map_bytes(struct arena *arena) {
+  size_t bytes = 0;
+
+  for (object_header *end_fencepost = arena->chunk_list;
+       end_fencepost != NULL; end_fencepost = end_fencepost->prev) {
+    bytes += map_chunk_bytes((size_t) ((char *) (end_fencepost + 1) -
+                                       (char *) end_fencepost->next));
+  }
+  return bytes;
+} /* heap_map_bytes() */
+
+/*
+ * Take a snapshot of the chunks of arena, whose mutex must be held, in
+ * snapshot, which holds heap_map_bytes() bytes.
+ */
+
+static void snapshot_heap_map(struct arena *arena, char *snapshot) {
+  size_t used = 0;
+
+  for (object_header *end_fencepost = arena->chunk_list;
+       end_fencepost != NULL; end_fencepost = end_fencepost->prev) {
+    char *start = (char *) end_fencepost->next;
+    size_t size = (size_t) ((char *) (end_fencepost + 1) - start);
+
+    struct map_chunk *chunk = (struct map_chunk *) (snapshot + used);
+    uint16_t *cells = (uint16_t *) (chunk + 1);
+    chunk->start = start;
+    chunk->size = size;
+    chunk->num_cells = (size + (MAP_CELL_SIZE - 1)) / MAP_CELL_SIZE;
+    used += map_chunk_bytes(size);
+
+    // Start from a chunk all in use, then take the free objects out
+
+    for (size_t cell = 0; cell < chunk->num_cells; cell++) {
+      size_t left = size - (cell * MAP_CELL_SIZE);
+      cells[cell] = (uint16_t) ((left < MAP_CELL_SIZE) ? left : MAP_CELL_SIZE);
+    }
+
+    object_header *object =
+      (object_header *) (start + sizeof(object_footer));
+    while (object != end_fencepost) {
+      size_t object_size = get_object_size(object);
+      if (get_object_status(object) == UNALLOCATED) {
+        size_t from = (size_t) ((char *) object - start);
+        size_t to = from + object_size;
+        for (size_t cell = from / MAP_CELL_SIZE;
+             cell <= (to - 1) / MAP_CELL_SIZE; cell++) {
+          size_t cell_start = cell * MAP_CELL_SIZE;
+          size_t low = (from > cell_start) ? from : cell_start;
+          size_t high = (to < cell_start + MAP_CELL_SIZE) ?
+                        to : cell_start + MAP_CELL_SIZE;
+          cells[cell] -= (uint16_t) (high - low);
+        }
+      }
+      object = (object_header *) ((char *) object + object_size);
+    }
+  }
+} /* snapshot_heap_map() */
+
+/*
+ * Write a map of which parts of each OS chunk are in use to buffer, at most
+ * size bytes long, terminator included: as text, one character per cell
+ * ('.' free, ':' less than half in use, '+' half or more, '#' all), or as
+ * an SVG image, one square per cell, darker the more of it is in use.
+ * Each arena is locked only while its snapshot is taken. Return the length
+ * of the whole map, like snprintf(3): if it is size or more, the map was
+ * truncated. Return -1, with errno set to ENOMEM, if there is no memory
+ * for a snapshot.
+ */
+
+int mymalloc_heap_map(char *buffer, size_t size,
+                      enum mymalloc_map_format format) {
+  char *snapshots[MAX_ARENAS] = { NULL };
+  size_t snapshot_sizes[MAX_ARENAS] = { 0 };
+  size_t capacities[MAX_ARENAS] = { 0 };
+  int svg_height = 0;
+
+  for (int i = 0; i < num_arenas; i++) {
+    struct arena *arena = &arenas[i];
+    lock_arena_mutex(arena);
+
+#if MYMALLOC_REMOTE_FREES
+    remote_free_drain(arena);
+#endif
+
+    // The snapshot is mapped rather than allocated, so as to leave the
+    // heap alone while looking at it
+
+    snapshot_sizes[i] = heap_map_bytes(arena);
+    capacities[i] = (snapshot_sizes[i] + (page_size - 1)) & ~(page_size - 1);
+    if (capacities[i] > 0) {
+      snapshots[i] = mmap(NULL, capacities[i], PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (snapshots[i] == MAP_FAILED) {
+        unlock_arena_mutex(arena);
+        while (--i >= 0) {
+          if (snapshots[i] != NULL) {
+            munmap(snapshots[i], capacities[i]);
+          }
+        }
+        errno = ENOMEM;
+        return -1;
+      }
+      snapshot_heap_map(arena, snapshots[i]);
+    }
+
+    unlock_arena_mutex(arena);
+  }
+
+  // Append with snprintf(), tracking the full length even once the buffer
+  // is full
+
+  size_t length = 0;
+#define APPEND(...) \
+  length += (size_t) snprintf(buffer + ((length < size) ? length : size), \
+                              (length < size) ? size - length : 0, \
+                              __VA_ARGS__)
+
+  if (format == MYMALLOC_MAP_SVG) {
+    for (int i = 0; i < num_arenas; i++) {
+      for (size_t used = 0; used < snapshot_sizes[i];) {
+        struct map_chunk *chunk = (struct map_chunk *) (snapshots[i] + used);
+        size_t rows = (chunk->num_cells + (MAP_COLUMNS - 1)) / MAP_COLUMNS;
+        svg_height += MAP_SVG_LABEL + ((int) rows * MAP_SVG_CELL);
+        used += map_chunk_bytes(chunk->size);
+      }
+    }
+    APPEND("<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"%d\" "
+           "height=\"%d\" font-family=\"monospace\" font-size=\"12\">\n",
+           MAP_COLUMNS * MAP_SVG_CELL, svg_height);
+  }
+  else {
+    APPEND("One character per %zu bytes: '.' free, ':' less than half in "
+           "use, '+' half or more, '#' all\n", MAP_CELL_SIZE);
+  }
+
+  int y = 0;
+  for (int i = 0; i < num_arenas; i++) {
+    for (size_t used = 0; used < snapshot_sizes[i];) {
+      struct map_chunk *chunk = (struct map_chunk *) (snapshots[i] + used);
+      uint16_t *cells = (uint16_t *) (chunk + 1);
+      size_t rows = (chunk->num_cells + (MAP_COLUMNS - 1)) / MAP_COLUMNS;
+      used += map_chunk_bytes(chunk->size);
+
+      if (format == MYMALLOC_MAP_SVG) {
+        APPEND("<text x=\"0\" y=\"%d\">arena %d chunk %p, %zu bytes</text>\n",
+               y + MAP_SVG_LABEL - 4, i, (void *) chunk->start, chunk->size);
+        y += MAP_SVG_LABEL;
+        APPEND("<rect x=\"0\" y=\"%d\" width=\"%d\" height=\"%d\" "
+               "fill=\"#eee\"/>\n", y, MAP_COLUMNS * MAP_SVG_CELL,
+               (int) rows * MAP_SVG_CELL);
+      }
+      else {
+        APPEND("arena %d chunk %p, %zu bytes\n", i, (void *) chunk->start,
+               chunk->size);
+      }
+
+      for (size_t cell = 0; cell < chunk->num_cells; cell++) {
+        size_t left = chunk->size - (cell * MAP_CELL_SIZE);
+        size_t cell_size = (left < MAP_CELL_SIZE) ? left : MAP_CELL_SIZE;
+        int column = (int) (cell % MAP_COLUMNS);
+
+        if (format == MYMALLOC_MAP_SVG) {
+          if (cells[cell] > 0) {
+            APPEND("<rect x=\"%d\" y=\"%d\" width=\"%d\" height=\"%d\" "
+                   "fill=\"#a00\" fill-opacity=\"%.2f\"/>\n",
+                   column * MAP_SVG_CELL,
+                   y + ((int) (cell / MAP_COLUMNS) * MAP_SVG_CELL),
+                   MAP_SVG_CELL, MAP_SVG_CELL,
+                   (double) cells[cell] / (double) cell_size);
+          }
+          continue;
+        }
+
+        char mark = '+';
+        if (cells[cell] == 0) {
+          mark = '.';
+        }
+        else if (cells[cell] == cell_size) {
+          mark = '#';
+        }
+        else if (2 * (size_t) cells[cell] < cell_size) {
+          mark = ':';
+        }
+        APPEND("%c%s", mark,
+               ((column == MAP_COLUMNS - 1) ||
+                (cell == chunk->num_cells - 1)) ? "\n" : "");
+      }
+
+      y += (int) rows * MAP_SVG_CELL;
+    }
+
+    if (snapshots[i] != NULL) {
+      munmap(snapshots[i], capacities[i]);
+    }
+  }
+
+  if (format == MYMALLOC_MAP_SVG) {
+    APPEND("</svg>\n");
+  }
+
+#undef APPEND
+  return (int) length;
+} /* mymalloc_heap_map() */
+
+/*
+ * Map size bytes of fresh memory for an OS chunk, honouring the huge page
+ * mode. Return NULL if mmap() fails.
+ */
+
+static void *map_chunk(size_t size) {
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+
+  if (huge_pages == HUGETLB_PAGES) {
+    void *chunk = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                       flags | MAP_HUGETLB, -1, 0);
+    if (chunk != MAP_FAILED) {
+      return chunk;
+    }
+
+    // No huge pages are reserved, so fall back to normal pages
+  }
+
+  if (huge_pages != TRANSPARENT_HUGE_PAGES) {
+    void *chunk = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+    return (chunk == MAP_FAILED) ? NULL : chunk;
+  }
+
+  // Map an extra huge page, then unmap whatever lies outside the
+  // HUGE_PAGE_SIZE-aligned range.
+
+  char *mapping = (char *) mmap(NULL, size + HUGE_PAGE_SIZE,
+                                PROT_READ | PROT_WRITE, flags, -1, 0);
+  if (mapping == MAP_FAILED) {
+    return NULL;
+  }
+
+  char *chunk = (char *) (((uintptr_t) mapping + (HUGE_PAGE_SIZE - 1)) &
+                          ~(uintptr_t) (HUGE_PAGE_SIZE - 1));
+  if (chunk > mapping) {
+    munmap(mapping, chunk - mapping);
+  }
+  if (chunk + size < mapping + size + HUGE_PAGE_SIZE) {
+    munmap(chunk + size, (mapping + size + HUGE_PAGE_SIZE) - (chunk + size));
+  }
+
+  madvise(chunk, size, MADV_HUGEPAGE);
+  return chunk;
+} /* map_chunk() */
+
+/*
+ * Use sbrk() or mmap(), depending on the backend, to get the memory from the
+ * OS for the main arena. Other arenas commit the next size bytes of their
+ * span instead. See sbrk(2), mmap(2) and mprotect(2). Return NULL if the OS
+ * (or the span) is out of memory.
+ */
+
+void *get_memory_from_os(struct arena *arena, size_t size) {
+  void *new_block = NULL;
+
+  if (arena->span != NULL) {
+    if ((size_t) (arena->span + ARENA_SPAN - arena->span_top) >= size) {
+      if (mprotect(arena->span_top, size, PROT_READ | PROT_WRITE) == 0) {
+        new_block = arena->span_top;
+        arena->span_top += size;
+        if (huge_pages == TRANSPARENT_HUGE_PAGES) {
+          madvise(new_block, size, MADV_HUGEPAGE);
+        }
+      }
+    }
+  }
+  else if (os_backend == MMAP_BACKEND) {
+    new_block = map_chunk(size);
+  }
+  else {
+    // Keep the break aligned, in case somebody else moved it
+
+    uintptr_t misalignment = (uintptr_t) sbrk(0) & (SIZE_PRECISION - 1);
+    if (misalignment != 0) {
+      sbrk(SIZE_PRECISION - misalignment);
+    }
+
+    new_block = sbrk(size);
+    if (new_block == (void *) -1) {
+      new_block = NULL;
+    }
+  }
+
+  if (new_block == NULL) {
+    return NULL;
+  }
+
+  arena->heap_size += size;
+  arena->num_chunks++;
+  shard_count(arena->stat_shard, STAT_OS_CHUNK_REQUESTS, 1);
+
+  return new_block;
+} /* get_memory_from_os() */
+
+/*
+ * Return whether the size bytes at memory, obtained from get_memory_from_os()
+ * for arena, can be given back: always for mmap(), and for sbrk() only if
+ * they are at the top of the heap, with nobody else having moved the break
+ * since. The span of an arena likewise shrinks from the top only.
+ */
+
+static int can_return_memory_to_os(struct arena *arena, void *memory,
+                                   size_t size) {
+  if (arena->span != NULL) {
+    return arena->span_top == (char *) memory + size;
+  }
+  return (os_backend == MMAP_BACKEND) || (sbrk(0) == (char *) memory + size);
+} /* can_return_memory_to_os() */
+
+/*
+ * Give the size bytes at memory, obtained from get_memory_from_os() for
+ * arena, back to the OS. can_return_memory_to_os() must have said so.
+ */
+
+static void return_memory_to_os(struct arena *arena, void *memory,
+                                size_t size) {
+  if (arena->span != NULL) {
+    // Mapping over the pages drops them and makes them inaccessible again
+
+    mmap(memory, size, PROT_NONE,
+         MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0);
+    arena->span_top -= size;
+  }
+  else if (os_backend == MMAP_BACKEND) {
+    munmap(memory, size);
+  }
+  else {
+    sbrk(-(intptr_t) size);
+  }
+
+  if ((arena->fresh_start >= (char *) memory) &&
+      (arena->fresh_start < (char *) memory + size)) {
+    arena->fresh_start = NULL;
+    arena->fresh_end = NULL;
+  }
+
+  arena->heap_size -= size;
+  arena->num_chunks--;
+  shard_count(arena->stat_shard, STAT_OS_CHUNK_RELEASES, 1);
+} /* return_memory_to_os() */
+
+/*
+ * Run when the program exists, and prints final statistics about the allocator.
+ */
+
+void at_exit_handler() {
+  if (verbose) {
+    print_stats();
+  }
+  if (profiling) {
+    print_profile();
+  }
+  if (tracing) {
+    flush_trace();
+  }
+
+#if MYMALLOC_DEBUG
+  mymalloc_check_heap();
+#endif
+} /* at_exit_handler() */
+
+
+//
+// Arenas
+//
+
+
+/*
+ * Return the arena owning the object pointed by ptr. Objects outside every
+ * span, mapped ones included, belong to the main arena.
+ */
+
+static inline struct arena *arena_of(void *ptr) {
+#if MYMALLOC_SLABS
+  if (is_slab_object(ptr)) {
+    return slab_run_of(ptr)->arena;
+  }
+#endif
+
+  uintptr_t offset = (uintptr_t) ((char *) ptr - arena_range);
+  if ((arena_range != NULL) &&
+      (offset < (size_t) (num_arenas - 1) * ARENA_SPAN)) {
+    return &arenas[1 + (offset / ARENA_SPAN)];
+  }
+  return &arenas[0];
+} /* arena_of() */
+
+/*
+ * Note that the mutex of arena was just locked after trying from start,
+ * returned by profile_start().
+ */
+
+static inline void arena_locked(struct arena *arena, uint64_t start) {
+  if (profiling) {
+    arena->locked_at = read_cycles();
+    profile_record(PROFILE_LOCK_WAIT, arena->locked_at - start);
+  }
+} /* arena_locked() */
+
+/*
+ * Lock the mutex of arena, counting the times it has to be waited for.
+ */
+
+static void lock_arena_mutex(struct arena *arena) {
+  uint64_t start = profile_start();
+
+  if (pthread_mutex_trylock(&arena->mutex) != 0) {
+    count(STAT_LOCK_CONTENTIONS, 1);
+    pthread_mutex_lock(&arena->mutex);
+  }
+  arena_locked(arena, start);
+} /* lock_arena_mutex() */
+
+/*
+ * Unlock the mutex of arena, locked by lock_arena_mutex() or lock_arena().
+ */
+
+static void unlock_arena_mutex(struct arena *arena) {
+  if (profiling) {
+    profile_record(PROFILE_LOCK_HOLD, read_cycles() - arena->locked_at);
+  }
+  pthread_mutex_unlock(&arena->mutex);
+} /* unlock_arena_mutex() */
+
+/*
+ * Lock and return an arena for the calling thread to allocate from. Threads
+ * are assigned an arena round-robin the first time they allocate, or take
+ * the one of the CPU they run on with the CPU policy. If that arena is busy,
+ * the first other arena whose mutex is free is used instead (and kept, with
+ * round-robin). If all of them are busy, wait for the preferred one.
+ */
+
+static struct arena *lock_arena() {
+#if MYMALLOC_ARENAS
+  uint64_t start = profile_start();
+  struct arena *preferred = thread_arena;
+
+  if (num_arenas <= 1) {
+    // Also the case for calls made before initialize() has run
+
+    preferred = &arenas[0];
+  }
+  else if (arena_policy == CPU_ARENAS) {
+    int cpu = sched_getcpu();
+    preferred = &arenas[(cpu >= 0) ? cpu % num_arenas : 0];
+  }
+  else if (preferred == NULL) {
+    int index = __atomic_fetch_add(&next_arena, 1, __ATOMIC_RELAXED);
+    preferred = &arenas[index % num_arenas];
+    thread_arena = preferred;
+  }
+
+  if (pthread_mutex_trylock(&preferred->mutex) == 0) {
+    arena_locked(preferred, start);
+    return preferred;
+  }
+
+  for (int i = 1; i < num_arenas; i++) {
+    struct arena *arena = &arenas[(preferred - arenas + i) % num_arenas];
+    if (pthread_mutex_trylock(&arena->mutex) == 0) {
+      arena_locked(arena, start);
+      thread_arena = arena;
+      return arena;
+    }
+  }
+
+  count(STAT_LOCK_CONTENTIONS, 1);
+  pthread_mutex_lock(&preferred->mutex);
+  arena_locked(preferred, start);
+  return preferred;
+#else
+  lock_arena_mutex(&arenas[0]);
+  return &arenas[0];
+#endif
+} /* lock_arena() */
+
+/*
+ * Allocate an object of size bytes from an arena of the calling thread,
+ * falling back to the main arena if the span of the thread's arena is used
+ * up. Return NULL if the OS is out of memory. zeroed is as for
+ * allocate_zeroable_object().
+ */
+
+static void *arena_allocate(struct stat_shard *shard, size_t size,
+                            int *zeroed) {
+  struct arena *arena = lock_arena();
+  arena->stat_shard = shard;
+  void *memory = allocate_zeroable_object(arena, size, zeroed);
+  unlock_arena_mutex(arena);
+
+  if ((memory == NULL) && (arena != &arenas[0])) {
+    lock_arena_mutex(&arenas[0]);
+    arenas[0].stat_shard = shard;
+    memory = allocate_zeroable_object(&arenas[0], size, zeroed);
+    unlock_arena_mutex(&arenas[0]);
+  }
+
+  return memory;
+} /* arena_allocate() */
+
+/*
+ * Count a request of size bytes in its statistics size class, and the
+ * usable bytes of the object at ptr, if any, as allocated, in shard.
+ */
+
+static void count_allocation(struct stat_shard *shard, size_t size,
+                             void *ptr) {
+  shard_count(shard, STAT_SIZE_CLASSES + stat_size_class(size), 1);
+  if (ptr != NULL) {
+    shard_count(shard, STAT_BYTES_ALLOCATED, usable_size(ptr));
+  }
+} /* count_allocation() */
+
+/*
+ * Allocate an object of size bytes aligned to alignment, a power of two,
+ * like arena_allocate(), and count it as a malloc() call.
+ */
+
+static void *arena_allocate_aligned(size_t alignment, size_t size) {
+  struct stat_shard *shard = current_stat_shard();
+  increase_malloc_calls(shard);
+
+  struct arena *arena = lock_arena();
+  arena->stat_shard = shard;
+  void *memory = allocate_aligned_object(arena, alignment, size);
+  unlock_arena_mutex(arena);
+
+  if ((memory == NULL) && (arena != &arenas[0])) {
+    lock_arena_mutex(&arenas[0]);
+    arenas[0].stat_shard = shard;
+    memory = allocate_aligned_object(&arenas[0], alignment, size);
+    unlock_arena_mutex(&arenas[0]);
+  }
+
+  count_allocation(shard, size, memory);
+  return memory;
+} /* arena_allocate_aligned() */
+
+
+#if MYMALLOC_THREAD_CACHE
+
+//
+// Thread cache
+//
+
+
+/*
+ * Return the thread cache bin serving requests of size bytes, or -1 if
+ * requests of that size bypass the cache.
+ */
+
+static int tcache_bin_index(size_t size) {
+  if (size > TCACHE_MAX_SIZE) {
+    return -1;
+  }
+
+  // Bins hold objects of the usable size allocate_object() gives requests
+  // of this size
+
+#if MYMALLOC_SLABS
+  if (size <= SLAB_MAX_SIZE) {
+    if (size < MINIMUM_SIZE) {
+      size = MINIMUM_SIZE;
+    }
+    size = (size + (SIZE_PRECISION - 1)) & ~(size_t) (SIZE_PRECISION - 1);
+  }
+  else
+#endif
+  {
+    size = round_object_size(size) - OBJECT_OVERHEAD;
+  }
+  if (size > TCACHE_MAX_SIZE) {
+    return -1;
+  }
+  return (int) (size / 8) - 1;
+} /* tcache_bin_index() */
+
+/*
+ * Push ptr onto a bin of the calling thread's cache.
+ */
+
+static void tcache_push(struct tcache_bin *bin, void *ptr) {
+  *(void **) ptr = bin->head;
+  bin->head = ptr;
+  bin->count++;
+} /* tcache_push() */
+
+/*
+ * Pop an object from a bin of the calling thread's cache.
+ * The bin must not be empty.
+ */
+
+static void *tcache_pop(struct tcache_bin *bin) {
+  void *ptr = bin->head;
+  bin->head = *(void **) ptr;
+  bin->count--;
+  return ptr;
+} /* tcache_pop() */
+
+/*
+ * Return up to count objects from bin to the free lists of their arenas,
+ * taking the mutex of each arena once per run of objects from it.
+ */
+
+static void tcache_flush(struct tcache_bin *bin, int count) {
+  struct arena *locked = NULL;
+
+  while ((count-- > 0) && (bin->head != NULL)) {
+    void *ptr = tcache_pop(bin);
+    struct arena *arena = arena_of(ptr);
+    if (arena != locked) {
+      if (locked != NULL) {
+        unlock_arena_mutex(locked);
+      }
+      lock_arena_mutex(arena);
+      locked = arena;
+    }
+    free_object(arena, ptr);
+  }
+
+  if (locked != NULL) {
+    unlock_arena_mutex(locked);
+  }
+} /* tcache_flush() */
+
+/*
+ * Return every cached object of the exiting thread to the free list.
+ * Registered as the destructor of tcache_key.
+ */
+
+static void tcache_flush_all(void *unused) {
+  for (int i = 0; i < TCACHE_NUM_BINS; i++) {
+    tcache_flush(&tcache[i], tcache[i].count);
+  }
+} /* tcache_flush_all() */
+
+/*
+ * Serve a request of size bytes from the calling thread's cache, refilling
+ * the bin in a batch from the free list on a miss. Return NULL if requests
+ * of this size bypass the cache.
+ */
+
+static void *tcache_allocate(size_t size) {
+  int index = tcache_bin_index(size);
+  if (index < 0) {
+    return NULL;
+  }
+
+  struct tcache_bin *bin = &tcache[index];
+  if (bin->head != NULL) {
+    return tcache_pop(bin);
+  }
+
+  // Make sure the cache gets flushed if this thread exits
+
+  if (!tcache_registered) {
+    tcache_registered = 1;
+    pthread_setspecific(tcache_key, tcache);
+  }
+
+  // Refill the bin, keeping only the blocks that fit it exactly
+  // (allocate_object() may hand out a larger block to avoid a split).
+
+  size_t bin_size = (size_t) (index + 1) * 8;
+  void *memory = NULL;
+
+  struct arena *arena = lock_arena();
+  for (int i = 0; i < TCACHE_BATCH; i++) {
+    void *ptr = allocate_object(arena, bin_size);
+    if (ptr == NULL) {
+      break;
+    }
+    if (memory == NULL) {
+      memory = ptr;
+    }
+    else if (usable_size(ptr) == bin_size) {
+      tcache_push(bin, ptr);
+    }
+    else {
+      free_object(arena, ptr);
+      break;
+    }
+  }
+  unlock_arena_mutex(arena);
+
+  return memory;
+} /* tcache_allocate() */
+
+/*
+ * Stash the object pointed by ptr in the calling thread's cache.
+ * Return 0 if the object does not belong in the cache.
+ */
+
+static int tcache_free(void *ptr) {
+  size_t size = usable_size(ptr);
+  int index = tcache_bin_index(size);
+  if ((index < 0) || ((size_t) (index + 1) * 8 != size)) {
+    return 0;
+  }
+
+  struct tcache_bin *bin = &tcache[index];
+  tcache_push(bin, ptr);
+
+  if (bin->count > TCACHE_MAX_COUNT) {
+    tcache_flush(bin, TCACHE_BATCH);
+  }
+  return 1;
+} /* tcache_free() */
+
+/*
+ * Stash the object pointed by ptr, allocated for a request of size bytes,
+ * in the calling thread's cache. The bin follows from size alone: the
+ * object is at least as large as the bin's class, which is all a request
+ * popping it needs. Return 0 if the object does not belong in the cache.
+ */
+
+static int tcache_free_sized(void *ptr, size_t size) {
+  int index = tcache_bin_index(size);
+  if (index < 0) {
+    return 0;
+  }
+
+#if MYMALLOC_SLABS
+  // A tiny request the slabs could not serve may have got less than its
+  // slab class, so only trust the size of objects that are in a slab
+
+  if ((size <= SLAB_MAX_SIZE) && !is_slab_object(ptr)) {
+    return tcache_free(ptr);
+  }
+#endif
+
+  struct tcache_bin *bin = &tcache[index];
+  tcache_push(bin, ptr);
+
+  if (bin->count > TCACHE_MAX_COUNT) {
+    tcache_flush(bin, TCACHE_BATCH);
+  }
+  return 1;
+} /* tcache_free_sized() */
+
+#endif // MYMALLOC_THREAD_CACHE
+
+
+#if MYMALLOC_DEBUG
+
+//
+// Debug mode
+//
+
+// The header right before every block in debug builds. offset is the
+// distance from the usable memory of the underlying object to the block,
+// which leaves the words free objects keep there alone, and size the size
+// of the request.
+
+struct debug_header {
+  size_t offset;
+  size_t size;
+  size_t magic;
+};
+
+/*
+ * Report problem with the block at ptr on stderr, without allocating, and
+ * abort.
+ */
+
+static void debug_abort(const char *problem, void *ptr) {
+  char message[128];
+  int length = snprintf(message, sizeof(message), "MyMalloc: %s: %p\n",
+                        problem, ptr);
+  if (length > 0) {
+    ssize_t written = write(2, message, ((size_t) length < sizeof(message)) ?
+                                        (size_t) length :
+                                        sizeof(message) - 1);
+    (void) written;
+  }
+  abort();
+} /* debug_abort() */
+
+/*
+ * Return the debug header of the block at ptr.
+ */
+
+static inline struct debug_header *debug_header_of(void *ptr) {
+  return (struct debug_header *) ptr - 1;
+} /* debug_header_of() */
+
+/*
+ * Return whether the redzones on either side of the block with the given
+ * header still hold nothing but canaries.
+ */
+
+static int debug_canaries_intact(struct debug_header *header) {
+  unsigned char *block = (unsigned char *) (header + 1);
+  unsigned char *front = block - header->offset;
+  unsigned char *back = block + header->size;
+
+  for (unsigned char *byte = front; byte < (unsigned char *) header; byte++) {
+    if (*byte != DEBUG_CANARY) {
+      return 0;
+    }
+  }
+  for (unsigned char *byte = back; byte < back + DEBUG_REDZONE; byte++) {
+    if (*byte != DEBUG_CANARY) {
+      return 0;
+    }
+  }
+  return 1;
+} /* debug_canaries_intact() */
+
+/*
+ * Allocate a block of size bytes aligned to alignment, a power of two or 0,
+ * inside an object with room for its redzones, and count it as a malloc()
+ * call. Return NULL if out of memory.
+ */
+
+static void *debug_allocate(size_t size, size_t alignment) {
+  size_t offset = (alignment > DEBUG_REDZONE) ? alignment : DEBUG_REDZONE;
+  if (size > (size_t) -1 - offset - DEBUG_REDZONE) {
+    return NULL;
+  }
+
+  char *memory = arena_allocate_aligned(alignment,
+                                        offset + size + DEBUG_REDZONE);
+  if (memory == NULL) {
+    return NULL;
+  }
+
+  char *ptr = memory + offset;
+  struct debug_header *header = debug_header_of(ptr);
+  memset(memory, DEBUG_CANARY, (char *) header - memory);
+  memset(ptr + size, DEBUG_CANARY, DEBUG_REDZONE);
+  header->offset = offset;
+  header->size = size;
+  header->magic = DEBUG_LIVE;
+  return ptr;
+} /* debug_allocate() */
+
+/*
+ * Return the debug header of the live block at ptr, aborting if ptr was
+ * already freed, does not point at a block, or its canaries are clobbered.
+ */
+
+static struct debug_header *debug_check(void *ptr) {
+  struct debug_header *header = debug_header_of(ptr);
+
+  if (header->magic == DEBUG_FREED) {
+    debug_abort("double free", ptr);
+  }
+  if ((header->magic != DEBUG_LIVE) || (header->offset < DEBUG_REDZONE)) {
+    debug_abort("bad pointer, or write right before block", ptr);
+  }
+  if (!debug_canaries_intact(header)) {
+    debug_abort("write out of the bounds of block", ptr);
+  }
+  return header;
+} /* debug_check() */
+
+/*
+ * Check and poison the block at ptr, if any, and return the usable memory
+ * of the object holding it, to be freed.
+ */
+
+static void *debug_release(void *ptr) {
+  if (ptr == NULL) {
+    return NULL;
+  }
+
+  struct debug_header *header = debug_check(ptr);
+  memset(ptr, DEBUG_POISON, header->size);
+  header->magic = DEBUG_FREED;
+  return (char *) ptr - header->offset;
+} /* debug_release() */
+
+/*
+ * Copy the block at ptr, if any, to a new block of size bytes, which is
+ * returned, like realloc(). The caller frees the old block: blocks always
+ * move in debug builds, so that stale pointers to them hit poison. Return
+ * NULL if out of memory.
+ */
+
+static void *debug_reallocate(void *ptr, size_t size) {
+  size_t old_size = (ptr != NULL) ? debug_check(ptr)->size : 0;
+
+  void *new_ptr = debug_allocate(size, 0);
+  if (new_ptr == NULL) {
+    return NULL;
+  }
+
+  if (ptr != NULL) {
+    memcpy(new_ptr, ptr, (old_size < size) ? old_size : size);
+  }
+  return new_ptr;
+} /* debug_reallocate() */
+
+#endif // MYMALLOC_DEBUG
+
+//
+// Tracing
+//
+
+
+/*
+ * Return the CLOCK_MONOTONIC time in nanoseconds.
+ */
+
+static inline uint64_t trace_clock() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return ((uint64_t) now.tv_sec * 1000000000) + (uint64_t) now.tv_nsec;
+} /* trace_clock() */
+
+/*
+ * Write the records of ring not written yet to the trace file. trace_mutex
+ * must be held.
+ */
+
+static void flush_trace_ring(struct trace_ring *ring) {
+  uint64_t tail = ring->tail;
+  uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+  while (tail != head) {
+    // Write up to the end of the ring at most, then wrap around
+
+    uint64_t index = tail % TRACE_RING_SIZE;
+    uint64_t count = head - tail;
+    if (count > TRACE_RING_SIZE - index) {
+      count = TRACE_RING_SIZE - index;
+    }
+
+    char *bytes = (char *) &ring->records[index];
+    size_t length = count * sizeof(struct mymalloc_trace_record);
+    while (length > 0) {
+      ssize_t written = write(trace_fd, bytes, length);
+      if (written < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+
+        // Drop the records rather than block the program
+
+        __atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+        return;
+      }
+      bytes += written;
+      length -= (size_t) written;
+    }
+    tail += count;
+  }
+
+  __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+} /* flush_trace_ring() */
+
+/*
+ * Write every ring out to the trace file.
+ */
+
+static void flush_trace() {
+  pthread_mutex_lock(&trace_mutex);
+  for (struct trace_ring *ring = __atomic_load_n(&trace_rings,
+                                                 __ATOMIC_ACQUIRE);
+       ring != NULL; ring = ring->next) {
+    flush_trace_ring(ring);
+  }
+  pthread_mutex_unlock(&trace_mutex);
+} /* flush_trace() */
+
+/*
+ * Body of the background thread writing the rings out.
+ */
+
+static void *trace_thread(void *unused) {
+  struct timespec interval = { 0, TRACE_FLUSH_INTERVAL };
+
+  for (;;) {
+    nanosleep(&interval, NULL);
+    flush_trace();
+  }
+  return NULL;
+} /* trace_thread() */
+
+/*
+ * Give the ring of an exiting thread up for reuse. Registered as the
+ * destructor of trace_key.
+ */
+
+static void retire_trace_ring(void *ring) {
+  __atomic_store_n(&((struct trace_ring *) ring)->in_use, 0,
+                   __ATOMIC_RELEASE);
+} /* retire_trace_ring() */
+
+/*
+ * Return the ring of the calling thread, claiming a retired ring or mapping
+ * a new one the first time. Return NULL if out of memory.
+ */
+
+static struct trace_ring *thread_trace_ring() {
+  struct trace_ring *ring = pthread_getspecific(trace_key);
+  if (ring != NULL) {
+    return ring;
+  }
+
+  for (ring = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE); ring != NULL;
+       ring = ring->next) {
+    int free = 0;
+    if (__atomic_compare_exchange_n(&ring->in_use, &free, 1, 0,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+      break;
+    }
+  }
+
+  if (ring == NULL) {
+    // Mapped rather than allocated, so as not to trace ourselves
+
+    ring = mmap(NULL, sizeof(struct trace_ring), PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED) {
+      return NULL;
+    }
+    ring->in_use = 1;
+
+    ring->next = __atomic_load_n(&trace_rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&trace_rings, &ring->next, ring, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+  }
+
+  pthread_setspecific(trace_key, ring);
+  return ring;
+} /* thread_trace_ring() */
+
+/*
+ * Log a call to the trace: op of size bytes on ptr, which returned result,
+ * made from caller. Only called in tracing mode.
+ */
+
+static void trace_call(enum mymalloc_trace_op op, size_t size, void *ptr,
+                       void *result, void *caller) {
+  struct trace_ring *ring = thread_trace_ring();
+  if (ring == NULL) {
+    return;
+  }
+
+  uint64_t head = ring->head;
+  if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >=
+      TRACE_RING_SIZE) {
+    pthread_mutex_lock(&trace_mutex);
+    flush_trace_ring(ring);
+    pthread_mutex_unlock(&trace_mutex);
+  }
+
+  struct mymalloc_trace_record *record =
+    &ring->records[head % TRACE_RING_SIZE];
+  record->timestamp = trace_clock();
+  record->size = size;
+  record->ptr = (uint64_t) (uintptr_t) ptr;
+  record->result = (uint64_t) (uintptr_t) result;
+  record->caller = (uint64_t) (uintptr_t) caller;
+  record->thread = (uint32_t) syscall(SYS_gettid);
+  record->op = op;
+
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+} /* trace_call() */
+
+/*
+ * Open the trace file at path, write its header, and start the thread
+ * writing the rings out. Tracing stays off if any of that fails.
+ */
+
+static void start_tracing(const char *path) {
+  trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (trace_fd < 0) {
+    return;
+  }
+
+  struct mymalloc_trace_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, MYMALLOC_TRACE_MAGIC, sizeof(header.magic));
+  header.version = MYMALLOC_TRACE_VERSION;
+  header.record_size = sizeof(struct mymalloc_trace_record);
+
+  pthread_t thread;
+  pthread_attr_t attributes;
+  pthread_attr_init(&attributes);
+  pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+
+  if ((write(trace_fd, &header, sizeof(header)) != sizeof(header)) ||
+      (pthread_key_create(&trace_key, retire_trace_ring) != 0) ||
+      (pthread_create(&thread, &attributes, trace_thread, NULL) != 0)) {
+    close(trace_fd);
+    pthread_attr_destroy(&attributes);
+    return;
+  }
+
+  pthread_attr_destroy(&attributes);
+  tracing = 1;
+} /* start_tracing() */
+
+
+//
+// Heap checking
+//
+
+
+/*
+ * Report problem with the object at where in arena on stderr. Return 1, to
+ * be added to the count of problems.
+ */
+
+static int heap_problem(struct arena *arena, void *where,
+                        const char *problem) {
+  fprintf(stderr, "mymalloc_check_heap: arena %d: %s at %p\n",
+          (int) (arena - arenas), problem, where);
+  return 1;
+} /* heap_problem() */
+
+#if MYMALLOC_DEBUG
+
+/*
+ * Check the canaries of the live block in the allocated object at object of
+ * arena, if it holds one. Return the number of problems found.
+ */
+
+static int check_debug_block(struct arena *arena, object_header *object) {
+  char *memory = usable_memory_of(object);
+  size_t usable = get_object_size(object) - OBJECT_OVERHEAD;
+
+  // The block is at DEBUG_REDZONE bytes, or at its alignment if larger
+
+  for (size_t offset = DEBUG_REDZONE; offset + DEBUG_REDZONE <= usable;
+       offset <<= 1) {
+    struct debug_header *header = debug_header_of(memory + offset);
+    if ((header->magic == DEBUG_LIVE) && (header->offset == offset)) {
+      if ((header->size > usable - offset - DEBUG_REDZONE) ||
+          !debug_canaries_intact(header)) {
+        return heap_problem(arena, header + 1, "clobbered canaries");
+      }
+      return 0;
+    }
+  }
+  return 0;
+} /* check_debug_block() */
+
+#endif // MYMALLOC_DEBUG
+
+/*
+ * Walk the OS chunk of arena ending at end_fencepost from fencepost to
+ * fencepost, checking the tags of every object. Add the number of free
+ * objects to *num_free, and of those belonging in the size tree to
+ * *num_in_tree. Return the number of problems found.
+ */
+
+static int check_chunk(struct arena *arena, object_header *end_fencepost,
+                       size_t *num_free, size_t *num_in_tree) {
+  int problems = 0;
+  int prev_free = 0;
+  object_header *object =
+    (object_header *) ((char *) end_fencepost->next + sizeof(object_footer));
+
+  while (object != end_fencepost) {
+    size_t size = get_object_size(object);
+    enum allocation_status status = get_object_status(object);
+
+    // Stop at a bad size, since the next object cannot be found
+
+    if ((size < MIN_OBJECT_SIZE) || ((size % SIZE_PRECISION) != 0) ||
+        (size > (size_t) ((char *) end_fencepost - (char *) object))) {
+      return problems + heap_problem(arena, object, "bad object size");
+    }
+    if ((status != ALLOCATED) && (status != UNALLOCATED)) {
+      return problems + heap_problem(arena, object, "bad object status");
+    }
+
+    int free = (status == UNALLOCATED);
+    object_footer *footer =
+      (object_footer *) ((char *) object + size - sizeof(object_footer));
+
+#if MYMALLOC_COMPACT_HEADERS
+    int footer_agrees = !free || (footer->object_size == size);
+#else
+    int footer_agrees = (footer->object_size == size) &&
+                        (footer->status == status);
+#endif
+    if (!footer_agrees) {
+      problems += heap_problem(arena, object, "footer disagrees with header");
+    }
+    if (prev_object_is_free(object) != prev_free) {
+      problems += heap_problem(arena, object,
+                               "wrong status of previous object");
+    }
+    if (free && prev_free) {
+      problems += heap_problem(arena, object, "adjacent free objects");
+    }
+
+    if (free) {
+      (*num_free)++;
+      if (in_size_tree(object)) {
+        (*num_in_tree)++;
+      }
+    }
+#if MYMALLOC_DEBUG
+    else {
+      problems += check_debug_block(arena, object);
+    }
+#endif
+
+    prev_free = free;
+    object = (object_header *) ((char *) object + size);
+  }
+
+  if (prev_object_is_free(end_fencepost) != prev_free) {
+    problems += heap_problem(arena, end_fencepost,
+                             "wrong status of previous object");
+  }
+  return problems;
+} /* check_chunk() */
+
+/*
+ * Walk the free lists of arena, which the heap walk found num_free free
+ * objects in, checking their links, order, and bins. Return the number of
+ * problems found.
+ */
+
+static int check_free_lists(struct arena *arena, size_t num_free) {
+  int problems = 0;
+  size_t num_listed = 0;
+
+  for (int bin = 0; bin < NUM_BINS; bin++) {
+    object_header *sentinel = &arena->free_list[bin];
+    object_header *prev = sentinel;
+    object_header *object = sentinel->next;
+
+    while (object != sentinel) {
+      // A list with more objects than the heap has free ones has a cycle
+
+      if (++num_listed > num_free) {
+        return problems + heap_problem(arena, object,
+                                       "free list longer than the heap");
+      }
+
+      if (object->prev != prev) {
+        problems += heap_problem(arena, object, "broken free list link");
+      }
+      if (get_object_status(object) != UNALLOCATED) {
+        problems += heap_problem(arena, object,
+                                 "allocated object on a free list");
+      }
+      else if (bin_index(get_object_size(object)) != bin) {
+        problems += heap_problem(arena, object,
+                                 "free object in the wrong bin");
+      }
+#if MYMALLOC_ADDRESS_ORDERED
+      if ((prev != sentinel) && (object < prev)) {
+        problems += heap_problem(arena, object,
+                                 "free list out of address order");
+      }
+#endif
+
+      prev = object;
+      object = object->next;
+    }
+
+    if (sentinel->prev != prev) {
+      problems += heap_problem(arena, sentinel, "broken free list link");
+    }
+
+#if MYMALLOC_SEGREGATED
+    int marked = (int) ((arena->bin_bitmap[bin / 64] >> (bin % 64)) & 1);
+    if (marked != (sentinel->next != sentinel)) {
+      problems += heap_problem(arena, sentinel, "bin bitmap out of date");
+    }
+#endif
+  }
+
+  if (num_listed != num_free) {
+    problems += heap_problem(arena, arena->free_list,
+                             "free objects missing from the free lists");
+  }
+  return problems;
+} /* check_free_lists() */
+
+#if MYMALLOC_QUICK_LISTS
+
+/*
+ * Check that the quick lists of arena hold allocated objects of the right
+ * sizes, as many as they count. Return the number of problems found.
+ */
+
+static int check_quick_lists(struct arena *arena) {
+  int problems = 0;
+
+  for (int index = 0; index < NUM_QUICK_LISTS; index++) {
+    int length = 0;
+    for (void *ptr = arena->quick_lists[index]; ptr != NULL;
+         ptr = *(void **) ptr) {
+      if (++length > QUICK_LIST_MAX) {
+        return problems + heap_problem(arena, ptr, "quick list too long");
+      }
+
+      object_header *object = header_of(ptr);
+      if ((get_object_status(object) != ALLOCATED) ||
+          (get_object_size(object) != (size_t) index * SIZE_PRECISION)) {
+        problems += heap_problem(arena, object, "bad object on a quick list");
+      }
+    }
+
+    if (length != arena->quick_counts[index]) {
+      problems += heap_problem(arena, &arena->quick_counts[index],
+                               "wrong quick list length");
+    }
+  }
+  return problems;
+} /* check_quick_lists() */
+
+#endif // MYMALLOC_QUICK_LISTS
+
+/*
+ * Check the subtree of arena's size tree rooted at object, whose nodes must
+ * all come after low and before high when those are not NULL, and add its
+ * number of nodes to *num_nodes. Return the number of problems found.
+ */
+
+static int check_size_tree(struct arena *arena, object_header *object,
+                           object_header *low, object_header *high,
+                           int depth, size_t *num_nodes) {
+  if (object == NULL) {
+    return 0;
+  }
+
+  // Far deeper than a treap of free objects gets, so there is a cycle
+
+  if (depth > 200) {
+    return heap_problem(arena, object, "size tree too deep");
+  }
+
+  int problems = 0;
+  (*num_nodes)++;
+
+  if ((get_object_status(object) != UNALLOCATED) || !in_size_tree(object)) {
+    problems += heap_problem(arena, object,
+                             "size tree node not a large free object");
+  }
+  if (((low != NULL) && !size_tree_less(low, object)) ||
+      ((high != NULL) && !size_tree_less(object, high))) {
+    problems += heap_problem(arena, object, "size tree out of order");
+  }
+
+  struct size_node *node = size_node(object);
+  problems += check_size_tree(arena, node->child[0], low, object, depth + 1,
+                              num_nodes);
+  problems += check_size_tree(arena, node->child[1], object, high, depth + 1,
+                              num_nodes);
+  return problems;
+} /* check_size_tree() */
+
+/*
+ * Check the consistency of every arena: walk each OS chunk from fencepost to
+ * fencepost checking the boundary tags and that no two free objects are
+ * adjacent, then check that the free lists and size tree hold exactly the
+ * free objects found, and that the quick lists hold allocated ones. In
+ * debug builds, also check the canaries of every live block. Problems are
+ * reported on stderr. Return their number.
+ */
+
+int mymalloc_check_heap() {
+  int problems = 0;
+
+  for (int i = 0; i < num_arenas; i++) {
+    struct arena *arena = &arenas[i];
+    lock_arena_mutex(arena);
+
+#if MYMALLOC_REMOTE_FREES
+    remote_free_drain(arena);
+#endif
+
+    size_t num_free = 0;
+    size_t num_in_tree = 0;
+    for (object_header *end_fencepost = arena->chunk_list;
+         end_fencepost != NULL; end_fencepost = end_fencepost->prev) {
+      problems += check_chunk(arena, end_fencepost, &num_free, &num_in_tree);
+    }
+
+    problems += check_free_lists(arena, num_free);
+#if MYMALLOC_QUICK_LISTS
+    problems += check_quick_lists(arena);
+#endif
+
+    size_t num_nodes = 0;
+    problems += check_size_tree(arena, arena->size_tree, NULL, NULL, 0,
+                                &num_nodes);
+    if (num_nodes != num_in_tree) {
+      problems += heap_problem(arena, arena->size_tree,
+                               "free objects missing from the size tree");
+    }
+
+    unlock_arena_mutex(arena);
+  }
+
+  return problems;
+} /* mymalloc_check_heap() */
+
+
+//
+// C interface
+//
+
+
+/*
+ * Allocate size bytes like malloc(), without tracing the call.
+ */
+
+static void *allocate_memory(size_t size) {
+  uint64_t start = profile_start();
+
+#if MYMALLOC_DEBUG
+  void *block = debug_allocate(size, 0);
+  profile_end(PROFILE_MALLOC, start);
+  return block;
+#endif
+
+  struct stat_shard *shard = current_stat_shard();
+
+#if MYMALLOC_THREAD_CACHE
+  void *cached = tcache_allocate(size);
+  if (cached != NULL) {
+    increase_malloc_calls(shard);
+    count_allocation(shard, size, cached);
+    profile_end(PROFILE_MALLOC, start);
+    return cached;
+  }
+#endif
+
+  increase_malloc_calls(shard);
+
+  void *memory = arena_allocate(shard, size, NULL);
+  count_allocation(shard, size, memory);
+
+  profile_end(PROFILE_MALLOC, start);
+  return memory;
+} /* allocate_memory() */
+
+/*
+ * Allocates size bytes of memory and returns the pointer to the
+ * newly-allocated memory. See malloc(3).
+ */
+
+extern void *malloc(size_t size) {
+  void *memory = allocate_memory(size);
+  if (tracing) {
+    trace_call(MYMALLOC_TRACE_MALLOC, size, NULL, memory,
+               __builtin_return_address(0));
+  }
+  return memory;
+} /* malloc() */
+
+/*
+ * Free the block of memory at ptr like free(), without tracing the call.
+ */
+
+static void free_memory(void *ptr) {
+  uint64_t start = profile_start();
+
+#if MYMALLOC_DEBUG
+  // Free the object holding the block
+
+  ptr = debug_release(ptr);
+#endif
+
+  struct stat_shard *shard = current_stat_shard();
+  if (ptr != NULL) {
+    shard_count(shard, STAT_BYTES_FREED, usable_size(ptr));
+  }
+
+#if MYMALLOC_THREAD_CACHE
+  if ((ptr != NULL) && tcache_free(ptr)) {
+    increase_free_calls(shard);
+    profile_end(PROFILE_FREE, start);
+    return;
+  }
+#endif
+
+  struct arena *arena = (ptr != NULL) ? arena_of(ptr) : &arenas[0];
+
+#if MYMALLOC_REMOTE_FREES
+  // Leave the object to whoever holds the mutex rather than wait for it
+
+  if (pthread_mutex_trylock(&arena->mutex) != 0) {
+    shard_count(shard, STAT_LOCK_CONTENTIONS, 1);
+    increase_free_calls(shard);
+    if (ptr != NULL) {
+      remote_free_push(arena, ptr);
+    }
+    profile_end(PROFILE_FREE, start);
+    return;
+  }
+  arena_locked(arena, start);
+  arena->stat_shard = shard;
+  remote_free_drain(arena);
+#else
+  lock_arena_mutex(arena);
+  arena->stat_shard = shard;
+#endif
+  increase_free_calls(shard);
+
+  if (ptr != NULL) {
+    free_object(arena, ptr);
+  }
+
+  unlock_arena_mutex(arena);
+  profile_end(PROFILE_FREE, start);
+} /* free_memory() */
+
+/*
+ * Frees a block of memory allocated by malloc(), calloc(), or realloc().
+ * See malloc(3).
+ */
+
+extern void free(void *ptr) {
+  // Trace first, since another thread may get the memory back right away
+
+  if (tracing) {
+    trace_call(MYMALLOC_TRACE_FREE, 0, ptr, NULL,
+               __builtin_return_address(0));
+  }
+  free_memory(ptr);
+} /* free() */
+
+/*
+ * Frees a block of memory of size bytes, the size it was allocated with.
+ * With the thread cache, the size picks the bin without checking the
+ * header. See free_sized(3).
+ */
+
+extern void free_sized(void *ptr, size_t size) {
+  if (tracing) {
+    trace_call(MYMALLOC_TRACE_FREE, 0, ptr, NULL,
+               __builtin_return_address(0));
+  }
+
+#if MYMALLOC_DEBUG
+  if ((ptr != NULL) && (debug_check(ptr)->size != size)) {
+    debug_abort("free_sized() with the wrong size", ptr);
+  }
+  free_memory(ptr);
+  return;
+#endif
+
+#if MYMALLOC_THREAD_CACHE
+  if ((ptr != NULL) && tcache_free_sized(ptr, size)) {
+    struct stat_shard *shard = current_stat_shard();
+    shard_count(shard, STAT_BYTES_FREED, usable_size(ptr));
+    increase_free_calls(shard);
+    return;
+  }
+#else
+  (void) size;
+#endif
+
+  free_memory(ptr);
+} /* free_sized() */
+
+/*
+ * Frees a block of memory of size bytes allocated with the given alignment
+ * by aligned_alloc(). See free_aligned_sized(3).
+ */
+
+extern void free_aligned_sized(void *ptr, size_t alignment, size_t size) {
+  // Over-aligned objects come from the free lists or mappings, never from
+  // the size classes, so only the alignment the size classes give for free
+  // can take the sized path
+
+  if (alignment <= SIZE_PRECISION) {
+    free_sized(ptr, size);
+  }
+  else {
+    free(ptr);
+  }
+} /* free_aligned_sized() */
+
+/*
+ * Allocate n objects of size bytes like n calls to malloc(), with a single
+ * lock of the arena, and store pointers to them in out. Return the number
+ * of objects allocated, which is less than n only if out of memory. The
+ * thread cache is bypassed.
+ */
+
+extern size_t mymalloc_bulk_alloc(size_t size, size_t n, void **out) {
+#if MYMALLOC_DEBUG
+  // Every block needs its own canaries
+
+  size_t allocated = 0;
+  while ((allocated < n) && ((out[allocated] = malloc(size)) != NULL)) {
+    allocated++;
+  }
+  return allocated;
+#endif
+
+  struct stat_shard *shard = current_stat_shard();
+  struct arena *arena = lock_arena();
+  arena->stat_shard = shard;
+  size_t done = allocate_objects(arena, size, n, out);
+  unlock_arena_mutex(arena);
+
+  if ((done < n) && (arena != &arenas[0])) {
+    lock_arena_mutex(&arenas[0]);
+    arenas[0].stat_shard = shard;
+    done += allocate_objects(&arenas[0], size, n - done, out + done);
+    unlock_arena_mutex(&arenas[0]);
+  }
+
+  size_t bytes = 0;
+  for (size_t i = 0; i < done; i++) {
+    bytes += usable_size(out[i]);
+  }
+  shard_count(shard, STAT_MALLOC_CALLS, done);
+  shard_count(shard, STAT_SIZE_CLASSES + stat_size_class(size), done);
+  shard_count(shard, STAT_BYTES_ALLOCATED, bytes);
+
+  if (tracing) {
+    for (size_t i = 0; i < done; i++) {
+      trace_call(MYMALLOC_TRACE_MALLOC, size, NULL, out[i],
+                 __builtin_return_address(0));
+    }
+  }
+  return done;
+} /* mymalloc_bulk_alloc() */
+
+/*
+ * Order pointers by address.
+ */
+
+static int compare_pointers(const void *a, const void *b) {
+  uintptr_t x = (uintptr_t) *(void * const *) a;
+  uintptr_t y = (uintptr_t) *(void * const *) b;
+
+  return (x < y) ? -1 : (x > y);
+} /* compare_pointers() */
+
+/*
+ * Free the n blocks of memory pointed by ptrs like n calls to free(), with
+ * a single lock of each arena they belong to. ptrs is sorted by address in
+ * place, so that blocks next to each other are coalesced in one pass.
+ */
+
+extern void mymalloc_bulk_free(void **ptrs, size_t n) {
+#if MYMALLOC_DEBUG
+  for (size_t i = 0; i < n; i++) {
+    free(ptrs[i]);
+  }
+  return;
+#endif
+
+  if (tracing) {
+    for (size_t i = 0; i < n; i++) {
+      trace_call(MYMALLOC_TRACE_FREE, 0, ptrs[i], NULL,
+                 __builtin_return_address(0));
+    }
+  }
+
+  qsort(ptrs, n, sizeof(void *), compare_pointers);
+
+  // NULLs come first
+
+  size_t i = 0;
+  while ((i < n) && (ptrs[i] == NULL)) {
+    i++;
+  }
+
+  size_t bytes = 0;
+  for (size_t j = i; j < n; j++) {
+    bytes += usable_size(ptrs[j]);
+  }
+  struct stat_shard *shard = current_stat_shard();
+  shard_count(shard, STAT_FREE_CALLS, n);
+  shard_count(shard, STAT_BYTES_FREED, bytes);
+
+  // Arenas own address ranges, so the blocks of each come in runs
+
+  while (i < n) {
+    struct arena *arena = arena_of(ptrs[i]);
+    size_t j = i + 1;
+    while ((j < n) && (arena_of(ptrs[j]) == arena)) {
+      j++;
+    }
+
+    lock_arena_mutex(arena);
+    arena->stat_shard = shard;
+#if MYMALLOC_REMOTE_FREES
+    remote_free_drain(arena);
+#endif
+    free_objects(arena, ptrs + i, j - i);
+    unlock_arena_mutex(arena);
+    i = j;
+  }
+} /* mymalloc_bulk_free() */
+
+/*
+ * Resize the block of memory at ptr like realloc(), without tracing the
+ * call.
+ */
+
+static void *reallocate_memory(void *ptr, size_t size) {
+  uint64_t start = profile_start();
+
+  struct stat_shard *shard = current_stat_shard();
+  increase_realloc_calls(shard);
+
+#if MYMALLOC_DEBUG
+  void *block = debug_reallocate(ptr, size);
+  if ((block != NULL) && (ptr != NULL)) {
+    free_memory(ptr);
+  }
+  profile_end(PROFILE_REALLOC, start);
+  return block;
+#endif
+
+  struct arena *arena = (ptr != NULL) ? arena_of(ptr) : &arenas[0];
+  size_t old_size = (ptr != NULL) ? usable_size(ptr) : 0;
+
+  if (ptr != NULL) {
+    // Try to resize in place first
+
+    lock_arena_mutex(arena);
+    arena->stat_shard = shard;
+    void *resized_ptr = reallocate_object(arena, ptr, size);
+    unlock_arena_mutex(arena);
+
+    if (resized_ptr != NULL) {
+      shard_count(shard, STAT_BYTES_FREED, old_size);
+      count_allocation(shard, size, resized_ptr);
+      profile_end(PROFILE_REALLOC, start);
+      return resized_ptr;
+    }
+  }
+
+  void *new_ptr = arena_allocate(shard, size, NULL);
+  count_allocation(shard, size, new_ptr);
+
+  // Copy old object only if ptr is non-null
+
+  if ((ptr != NULL) && (new_ptr != NULL)) {
+    // Copy everything from the old ptr.
+    // We don't need to hold the mutex here because it is undefined behavior
+    // (a double free) for the calling program to free() or realloc() this
+    // memory once realloc() has already been called.
+
+    size_t size_to_copy = old_size;
+    if (size_to_copy > size) {
+      // If we are shrinking, don't write past the end of the new block
+
+      size_to_copy = size;
+    }
+
+    memcpy(new_ptr, ptr, size_to_copy);
+
+    shard_count(shard, STAT_BYTES_FREED, old_size);
+    lock_arena_mutex(arena);
+    arena->stat_shard = shard;
+    free_object(arena, ptr);
+    unlock_arena_mutex(arena);
+  }
+
+  profile_end(PROFILE_REALLOC, start);
+  return new_ptr;
+} /* reallocate_memory() */
+
+/*
+ * Resizes the block of memory at ptr, which was allocated by
+ * malloc(), realloc(), or calloc(), and returns a pointer to
+ * the new resized block. See malloc(3).
+ */
+
+extern void *realloc(void *ptr, size_t size) {
+  void *new_ptr = reallocate_memory(ptr, size);
+  if (tracing) {
+    trace_call(MYMALLOC_TRACE_REALLOC, size, ptr, new_ptr,
+               __builtin_return_address(0));
+  }
+  return new_ptr;
+} /* realloc() */
+
+/*
+ * Returns free memory to the OS: entirely free chunks are released (with
+ * sbrk(), only those at the top of the heap) unless pad is non-zero, and
+ * the whole pages inside free objects are given back with madvise().
+ * Returns 1 if any memory was released, and 0 otherwise. See malloc_trim(3).
+ */
+
+extern int malloc_trim(size_t pad) {
+  size_t released = 0;
+
+  for (int i = 0; i < num_arenas; i++) {
+    struct arena *arena = &arenas[i];
+    lock_arena_mutex(arena);
+
+#if MYMALLOC_REMOTE_FREES
+    remote_free_drain(arena);
+#endif
+#if MYMALLOC_QUICK_LISTS
+    quick_lists_flush_all(arena);
+#endif
+
+    released += trim_heap(arena, pad, 0);
+
+    unlock_arena_mutex(arena);
+  }
+
+  return released > 0;
+} /* malloc_trim() */
+
+/*
+ * Allocate size bytes of memory initialized to 0 like calloc(), without
+ * tracing the call.
+ */
+
+static void *allocate_zeroed_memory(size_t size) {
+  uint64_t start = profile_start();
+
+  struct stat_shard *shard = current_stat_shard();
+  increase_calloc_calls(shard);
+
+#if MYMALLOC_DEBUG
+  void *block = debug_allocate(size, 0);
+  if (block != NULL) {
+    memset(block, 0, size);
+  }
+  profile_end(PROFILE_CALLOC, start);
+  return block;
+#endif
+
+  void *ptr = NULL;
+  int zeroed = 0;
+
+#if MYMALLOC_THREAD_CACHE
+  ptr = tcache_allocate(size);
+#endif
+
+  if (ptr == NULL) {
+    ptr = arena_allocate(shard, size, &zeroed);
+  }
+  count_allocation(shard, size, ptr);
+
+  if (ptr && !zeroed) {
+    // No error, so initialize chunk with 0s, unless it is fresh from the OS
+
+    memset(ptr, 0, size);
+  }
+
+  profile_end(PROFILE_CALLOC, start);
+  return ptr;
+} /* allocate_zeroed_memory() */
+
+/*
+ * Allocates contiguous memory large enough to fit num_elems elements
+ * of size elem_size. Initialize the memory to 0. Return a pointer to
+ * the beginning of the newly-allocated memory. See malloc(3).
+ */
+
+extern void *calloc(size_t num_elems, size_t elem_size) {
+  // Find total size needed, which may not fit in a size_t
+
+  size_t size;
+  if (__builtin_mul_overflow(num_elems, elem_size, &size)) {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  void *ptr = allocate_zeroed_memory(size);
+  if (tracing) {
+    trace_call(MYMALLOC_TRACE_CALLOC, size, NULL, ptr,
+               __builtin_return_address(0));
+  }
+  return ptr;
 } /* calloc() */
+
+/*
+ * Return the number of bytes the block of memory at ptr can hold, which may
+ * be more than it was allocated with. See malloc_usable_size(3).
+ */
+
+extern size_t malloc_usable_size(void *ptr) {
+#if MYMALLOC_DEBUG
+  return (ptr != NULL) ? debug_check(ptr)->size : 0;
+#endif
+
+  return (ptr != NULL) ? usable_size(ptr) : 0;
+} /* malloc_usable_size() */
+
+/*
+ * Allocates size bytes of memory aligned to alignment, which must be a power
+ * of two multiple of sizeof(void *), and stores the pointer to it in
+ * *memptr. Return 0, or EINVAL or ENOMEM. See posix_memalign(3).
+ */
+
+extern int posix_memalign(void **memptr, size_t alignment, size_t size) {
+  if ((alignment < sizeof(void *)) || ((alignment & (alignment - 1)) != 0)) {
+    return EINVAL;
+  }
+
+#if MYMALLOC_DEBUG
+  void *ptr = debug_allocate(size, alignment);
+#else
+  void *ptr = arena_allocate_aligned(alignment, size);
+#endif
+  if (tracing) {
+    trace_call(MYMALLOC_TRACE_MEMALIGN, size, (void *) alignment, ptr,
+               __builtin_return_address(0));
+  }
+  if (ptr == NULL) {
+    return ENOMEM;
+  }
+
+  *memptr = ptr;
+  return 0;
+} /* posix_memalign() */
+
+/*
+ * Allocates size bytes of memory aligned to alignment, which must be a power
+ * of two. See aligned_alloc(3).
+ */
+
+extern void *aligned_alloc(size_t alignment, size_t size) {
+  if ((alignment == 0) || ((alignment & (alignment - 1)) != 0)) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+#if MYMALLOC_DEBUG
+  void *ptr = debug_allocate(size, alignment);
+#else
+  void *ptr = arena_allocate_aligned(alignment, size);
+#endif
+  if (tracing) {
+    trace_call(MYMALLOC_TRACE_MEMALIGN, size, (void *) alignment, ptr,
+               __builtin_return_address(0));
+  }
+  if (ptr == NULL) {
+    errno = ENOMEM;
+  }
+  return ptr;
+} /* aligned_alloc() */
+
+/*
+ * Allocates size bytes of memory aligned to alignment, rounded up to a power
+ * of two if it is not one. See memalign(3).
+ */
+
+extern void *memalign(size_t alignment, size_t size) {
+  if ((alignment & (alignment - 1)) != 0) {
+    if (alignment > ((size_t) -1 >> 1) + 1) {
+      errno = EINVAL;
+      return NULL;
+    }
+    alignment = (size_t) 1 << ((sizeof(size_t) * 8) -
+                               __builtin_clzl((unsigned long) alignment));
+  }
+
+#if MYMALLOC_DEBUG
+  void *ptr = debug_allocate(size, alignment);
+#else
+  void *ptr = arena_allocate_aligned(alignment, size);
+#endif
+  if (tracing) {
+    trace_call(MYMALLOC_TRACE_MEMALIGN, size, (void *) alignment, ptr,
+               __builtin_return_address(0));
+  }
+  if (ptr == NULL) {
+    errno = ENOMEM;
+  }
+  return ptr;
+} /* memalign() */
+
+/*
+ * Allocates size bytes of page-aligned memory. See valloc(3).
+ */
+
+extern void *valloc(size_t size) {
+  return memalign(page_size, size);
+} /* valloc() */
+
+/*
+ * Allocates size bytes, rounded up to a whole number of pages, of
+ * page-aligned memory. See valloc(3).
+ */
+
+extern void *pvalloc(size_t size) {
+  size_t rounded_size = (size + (page_size - 1)) & ~(page_size - 1);
+  if (rounded_size < size) {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  return memalign(page_size, rounded_size);
+} /* pvalloc() */
+
+
+//
+// Regions
+//
+
+// A region hands out memory from blocks, themselves objects of the heap,
+// each starting with a struct region_block. Blocks double in size from
+// REGION_MIN_BLOCK up to REGION_MAX_BLOCK bytes, so that a region holding a
+// lot needs few of them; past mmap_threshold they are mapped, and go back to
+// the OS with the region. A request larger than a quarter of the next block
+// gets a block of its own.
+
+#define REGION_MIN_BLOCK ((size_t) 4096)
+#define REGION_MAX_BLOCK ((size_t) 1 << 20)
+
+struct region_block {
+  struct region_block *next;
+
+  // Bytes after the header
+
+  size_t size;
+};
+
+// The first block on the list is the one memory is carved from, between
+// next and end
+
+struct region {
+  struct region_block *blocks;
+  char *next;
+  char *end;
+  size_t block_size;
+};
+
+/*
+ * Free the blocks on the list starting at block.
+ */
+
+static void free_region_blocks(struct region_block *block) {
+  while (block != NULL) {
+    struct region_block *next = block->next;
+    free(block);
+    block = next;
+  }
+} /* free_region_blocks() */
+
+/*
+ * Create an empty region. Return NULL if out of memory.
+ */
+
+extern struct region *region_create() {
+  struct region *region = malloc(sizeof(struct region));
+  if (region == NULL) {
+    return NULL;
+  }
+
+  region->blocks = NULL;
+  region->next = NULL;
+  region->end = NULL;
+  region->block_size = REGION_MIN_BLOCK;
+  return region;
+} /* region_create() */
+
+/*
+ * Allocate size bytes from region, aligned like malloc(). The memory has no
+ * header, and is only freed with the whole region. Return NULL if out of
+ * memory.
+ */
+
+extern void *region_alloc(struct region *region, size_t size) {
+  if (size > SIZE_MAX / 2) {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  size_t rounded_size = (size + (SIZE_PRECISION - 1)) &
+                        ~(size_t) (SIZE_PRECISION - 1);
+  if (rounded_size == 0) {
+    rounded_size = SIZE_PRECISION;
+  }
+
+  if (rounded_size <= (size_t) (region->end - region->next)) {
+    void *memory = region->next;
+    region->next += rounded_size;
+    return memory;
+  }
+
+  int own_block = (rounded_size > region->block_size / 4);
+  size_t block_size = own_block ? rounded_size : region->block_size;
+  struct region_block *block =
+    malloc(sizeof(struct region_block) + block_size);
+  if (block == NULL) {
+    return NULL;
+  }
+  block->size = block_size;
+
+  if (own_block && (region->blocks != NULL)) {
+    // Keep carving the current block
+
+    block->next = region->blocks->next;
+    region->blocks->next = block;
+    return block + 1;
+  }
+
+  block->next = region->blocks;
+  region->blocks = block;
+  region->next = (char *) (block + 1) + rounded_size;
+  region->end = (char *) (block + 1) + block_size;
+  if (!own_block && (region->block_size < REGION_MAX_BLOCK)) {
+    region->block_size *= 2;
+  }
+  return block + 1;
+} /* region_alloc() */
+
+/*
+ * Free everything allocated from region at once, keeping only the block
+ * memory is carved from for reuse.
+ */
+
+extern void region_reset(struct region *region) {
+  struct region_block *block = region->blocks;
+  if (block == NULL) {
+    return;
+  }
+
+  free_region_blocks(block->next);
+  block->next = NULL;
+  region->next = (char *) (block + 1);
+  region->end = region->next + block->size;
+} /* region_reset() */
+
+/*
+ * Free everything allocated from region, and region itself.
+ */
+
+extern void region_destroy(struct region *region) {
+  if (region == NULL) {
+    return;
+  }
+
+  free_region_blocks(region->blocks);
+  free(region);
+} /* region_destroy() */
+
+
+//
+// Pools
+//
+
+// A pool hands out objects of one size, carved from slabs of at least
+// POOL_SLAB_SIZE bytes that are mapped apart from the arenas, so that they
+// neither count as heap nor pin it, and are never given back. Each thread
+// keeps a stack of free objects of the pool, chained through their first
+// word, behind a pthread key.
+// Objects move between that stack and the pool's shared stack POOL_BATCH at
+// a time, under the pool's mutex, when the thread's stack is empty or holds
+// POOL_CACHE_MAX objects. A thread's stack goes back to the pool when the
+// thread exits.
+
+#define POOL_SLAB_SIZE ((size_t) 64 * 1024)
+#define POOL_BATCH (32)
+#define POOL_CACHE_MAX (2 * POOL_BATCH)
+
+struct pool {
+  size_t object_size;
+  size_t alignment;
+  void (*constructor)(void *object);
+  void (*destructor)(void *object);
+  pthread_key_t key;
+
+  // Free objects given back by threads, and the part of the newest slab
+  // never handed out, under mutex
+
+  pthread_mutex_t mutex;
+  void *free_objects;
+  char *next;
+  char *end;
+};
+
+struct pool_cache {
+  struct pool *pool;
+  void *free_objects;
+  int count;
+};
+
+/*
+ * Give the count objects on top of the stack of cache back to its pool.
+ */
+
+static void pool_flush(struct pool_cache *cache, int count) {
+  struct pool *pool = cache->pool;
+
+  pthread_mutex_lock(&pool->mutex);
+  for (int i = 0; (i < count) && (cache->free_objects != NULL); i++) {
+    void *object = cache->free_objects;
+    cache->free_objects = *(void **) object;
+    cache->count--;
+    *(void **) object = pool->free_objects;
+    pool->free_objects = object;
+  }
+  pthread_mutex_unlock(&pool->mutex);
+} /* pool_flush() */
+
+/*
+ * Give the stack of an exiting thread back to its pool. Run by the pthread
+ * key of the pool.
+ */
+
+static void pool_cache_exit(void *cache) {
+  struct pool_cache *exiting = cache;
+
+  pool_flush(exiting, exiting->count);
+  free(exiting);
+} /* pool_cache_exit() */
+
+/*
+ * Get a new slab for pool, whose mutex must be held. Return whether there
+ * was memory for it.
+ */
+
+static int pool_add_slab(struct pool *pool) {
+  size_t size = (pool->object_size * POOL_BATCH) + pool->alignment;
+  if (size < POOL_SLAB_SIZE) {
+    size = POOL_SLAB_SIZE;
+  }
+  size = (size + (page_size - 1)) & ~(page_size - 1);
+
+  char *slab = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (slab == MAP_FAILED) {
+    return 0;
+  }
+  __atomic_fetch_add(&pool_size, size, __ATOMIC_RELAXED);
+
+  pool->next = (char *) (((uintptr_t) slab + (pool->alignment - 1)) &
+                         ~(uintptr_t) (pool->alignment - 1));
+  pool->end = slab + size;
+  return 1;
+} /* pool_add_slab() */
+
+/*
+ * Take a batch of objects from pool for the calling thread, whose stack,
+ * cache, is empty, or NULL if the thread has none yet. Return one of them,
+ * leaving the rest on the stack, or NULL if out of memory.
+ */
+
+static void *pool_refill(struct pool *pool, struct pool_cache *cache) {
+  if (cache == NULL) {
+    cache = malloc(sizeof(struct pool_cache));
+    if (cache != NULL) {
+      cache->pool = pool;
+      cache->free_objects = NULL;
+      cache->count = 0;
+      pthread_setspecific(pool->key, cache);
+    }
+  }
+
+  // Without a stack, take a single object
+
+  int wanted = (cache != NULL) ? POOL_BATCH : 1;
+  void *taken = NULL;
+  int num_taken = 0;
+
+  pthread_mutex_lock(&pool->mutex);
+  while (num_taken < wanted) {
+    void *object = pool->free_objects;
+    if (object != NULL) {
+      pool->free_objects = *(void **) object;
+    }
+    else {
+      if (((size_t) (pool->end - pool->next) < pool->object_size) &&
+          !pool_add_slab(pool)) {
+        break;
+      }
+      object = pool->next;
+      pool->next += pool->object_size;
+    }
+
+    *(void **) object = taken;
+    taken = object;
+    num_taken++;
+  }
+  pthread_mutex_unlock(&pool->mutex);
+
+  if (taken == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  void *object = taken;
+  if (cache != NULL) {
+    cache->free_objects = *(void **) object;
+    cache->count = num_taken - 1;
+  }
+  return object;
+} /* pool_refill() */
+
+/*
+ * Create a pool of objects of object_size bytes aligned to alignment, a
+ * power of two (or 0 for the alignment of malloc()). constructor and
+ * destructor may be NULL. Return NULL if out of memory or pthread keys, or
+ * if alignment is not a power of two.
+ */
+
+extern struct pool *pool_create(size_t object_size, size_t alignment,
+                                void (*constructor)(void *object),
+                                void (*destructor)(void *object)) {
+  if (alignment == 0) {
+    alignment = SIZE_PRECISION;
+  }
+  if ((alignment & (alignment - 1)) != 0) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  // Free objects hold a pointer
+
+  if (alignment < sizeof(void *)) {
+    alignment = sizeof(void *);
+  }
+  if (object_size < sizeof(void *)) {
+    object_size = sizeof(void *);
+  }
+  object_size = (object_size + (alignment - 1)) & ~(alignment - 1);
+  if (object_size > SIZE_MAX / (2 * POOL_BATCH)) {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  struct pool *pool = malloc(sizeof(struct pool));
+  if (pool == NULL) {
+    return NULL;
+  }
+  if (pthread_key_create(&pool->key, pool_cache_exit) != 0) {
+    free(pool);
+    errno = EAGAIN;
+    return NULL;
+  }
+
+  pool->object_size = object_size;
+  pool->alignment = alignment;
+  pool->constructor = constructor;
+  pool->destructor = destructor;
+  pthread_mutex_init(&pool->mutex, NULL);
+  pool->free_objects = NULL;
+  pool->next = NULL;
+  pool->end = NULL;
+  return pool;
+} /* pool_create() */
+
+/*
+ * Return an object of pool, after running the constructor of the pool on
+ * it, or NULL if out of memory.
+ */
+
+extern void *pool_get(struct pool *pool) {
+  struct pool_cache *cache = pthread_getspecific(pool->key);
+  void *object;
+
+  if ((cache != NULL) && (cache->free_objects != NULL)) {
+    object = cache->free_objects;
+    cache->free_objects = *(void **) object;
+    cache->count--;
+  }
+  else {
+    object = pool_refill(pool, cache);
+    if (object == NULL) {
+      return NULL;
+    }
+  }
+
+  if (pool->constructor != NULL) {
+    pool->constructor(object);
+  }
+  return object;
+} /* pool_get() */
+
+/*
+ * Give object back to pool, after running the destructor of the pool on
+ * it.
+ */
+
+extern void pool_put(struct pool *pool, void *object) {
+  if (pool->destructor != NULL) {
+    pool->destructor(object);
+  }
+
+  struct pool_cache *cache = pthread_getspecific(pool->key);
+  if (cache == NULL) {
+    // The thread never got an object from the pool
+
+    pthread_mutex_lock(&pool->mutex);
+    *(void **) object = pool->free_objects;
+    pool->free_objects = object;
+    pthread_mutex_unlock(&pool->mutex);
+    return;
+  }
+
+  *(void **) object = cache->free_objects;
+  cache->free_objects = object;
+  if (++cache->count >= POOL_CACHE_MAX) {
+    pool_flush(cache, POOL_BATCH);
+  }
+} /* pool_put() */
@@ -1,14 +1,49 @@
 #ifndef MYMALLOC_H
 #define MYMALLOC_H
 
+#include <stdint.h>
 #include <unistd.h>
 
 enum allocation_status {
   UNALLOCATED,
   ALLOCATED,
-  SENTINEL
+  SENTINEL,
+  MAPPED
 };
 
+// Build with -DMYMALLOC_COMPACT_HEADERS=1 for the compact object layout:
+// the status lives in the low bits of object_size, along with a flag telling
+// whether the previous object is allocated. Allocated objects then carry an
+// 8-byte header only; next and prev overlay the usable memory of free
+// objects, and only free objects have a footer.
+
+#ifndef MYMALLOC_COMPACT_HEADERS
+#define MYMALLOC_COMPACT_HEADERS (0)
+#endif
+
+#if MYMALLOC_COMPACT_HEADERS
+
+struct object_header_struct {
+  // Size of the object including header, ORed with its status
+  // and the PREV_ALLOCATED flag
+
+  size_t object_size;
+
+  // Free list pointers, valid only while the object is free
+
+  struct object_header_struct *next;
+  struct object_header_struct *prev;
+};
+typedef struct object_header_struct object_header;
+
+struct object_footer_struct{
+  // Size of the free object including header
+
+  size_t object_size;
+};
+
+#else
+
 struct object_header_struct {
   // Size of the object including header and footer
 
@@ -34,15 +69,25 @@ struct object_footer_struct{
 
   enum allocation_status status;
 };
+
+#endif // MYMALLOC_COMPACT_HEADERS
+
 typedef struct object_footer_struct object_footer;
 
 // Direct gcc to run this function before main()
 
 void initialize() __attribute__ ((constructor));
 
-void *allocate_object(size_t size);
+struct arena;
+
+void *allocate_object(struct arena *arena, size_t size);
+
+void *allocate_aligned_object(struct arena *arena, size_t alignment,
+                              size_t size);
 
-void free_object(void *ptr);
+void free_object(struct arena *arena, void *ptr);
+
+void *reallocate_object(struct arena *arena, void *ptr, size_t size);
 
 size_t object_size(void *ptr);
 
@@ -50,9 +95,207 @@ void at_exit_handler();
 
 void print_stats();
 
+void print_profile();
+
 void print_list();
 
-void *get_memory_from_os(size_t size);
+// Check the consistency of the heap, reporting problems on stderr. Returns
+// their number.
+
+int mymalloc_check_heap();
+
+void *get_memory_from_os(struct arena *arena, size_t size);
+
+int malloc_trim(size_t pad);
+
+void *memalign(size_t alignment, size_t size);
+
+void *pvalloc(size_t size);
+
+size_t malloc_usable_size(void *ptr);
+
+void free_sized(void *ptr, size_t size);
+
+void free_aligned_sized(void *ptr, size_t alignment, size_t size);
+
+// Allocate n objects of size bytes at once, storing pointers to them in out.
+// Returns how many were allocated, fewer than n only if out of memory.
+
+size_t mymalloc_bulk_alloc(size_t size, size_t n, void **out);
+
+// Free n objects at once. Sorts ptrs by address in place.
+
+void mymalloc_bulk_free(void **ptrs, size_t n);
+
+// Regions: memory allocated from a region has no header and is never freed
+// on its own. region_reset() frees all of it at once, and region_destroy()
+// the region as well. A region must not be used by two threads at a time.
+
+struct region;
+
+struct region *region_create();
+
+void *region_alloc(struct region *region, size_t size);
+
+void region_reset(struct region *region);
+
+void region_destroy(struct region *region);
+
+// Pools of objects of one size. pool_get() and pool_put() work from a stack
+// of free objects of the calling thread, and lock the pool only to move
+// objects in batches between it and that stack. Pool memory is type-stable:
+// it is never freed, nor used for anything but objects of its pool, so a
+// freed object may still be read, though its first word then links it to
+// the next free object. constructor and destructor, if not NULL, run on
+// each object in pool_get() and pool_put(). Each pool uses a pthread key.
+
+struct pool;
+
+struct pool *pool_create(size_t object_size, size_t alignment,
+                         void (*constructor)(void *object),
+                         void (*destructor)(void *object));
+
+void *pool_get(struct pool *pool);
+
+void pool_put(struct pool *pool, void *object);
+
+// Statistics of the allocator, see mymalloc_stats(). Sizes are in usable
+// bytes. Class 0 of size_class_requests counts requests of up to 8 bytes,
+// and class i those from 2**(i+2)+1 to 2**(i+3) bytes; the last class also
+// counts every larger request.
+
+#define MYMALLOC_STAT_CLASSES (24)
+
+struct mymalloc_stats {
+  unsigned long long malloc_calls;
+  unsigned long long free_calls;
+  unsigned long long realloc_calls;
+  unsigned long long calloc_calls;
+  unsigned long long bytes_allocated;
+  unsigned long long bytes_freed;
+  unsigned long long live_bytes;
+  unsigned long long size_class_requests[MYMALLOC_STAT_CLASSES];
+
+  // Times a thread found the mutex it needed busy
+
+  unsigned long long lock_contentions;
+
+  // OS chunks requested and given back, and objects given their own mapping
+
+  unsigned long long os_chunk_requests;
+  unsigned long long os_chunk_releases;
+  unsigned long long mapped_objects;
+
+  // Free objects split to serve a request, and merges of free neighbours
+
+  unsigned long long splits;
+  unsigned long long coalesces;
+
+  // Total size of the OS chunks currently held, and of the slabs of the
+  // pools, which are not part of the heap
+
+  size_t heap_size;
+  size_t pool_size;
+};
+
+void mymalloc_stats(struct mymalloc_stats *stats);
+
+int mymalloc_stats_json(char *buffer, size_t size);
+
+// Shape of the heap, see mymalloc_heap_info(). Sizes are in bytes, headers
+// and footers included, and cover the OS chunks of the arenas: objects with
+// a mapping of their own, slab runs, and objects in the thread caches or
+// on quick lists are not counted as free. Bucket k of free_size_histogram
+// counts free objects of 2**k to 2**(k+1)-1 bytes.
+
+#define MYMALLOC_HEAP_BUCKETS (32)
+#define MYMALLOC_MAX_ARENAS (64)
+
+struct mymalloc_arena_info {
+  size_t heap_size;
+  size_t free_bytes;
+  size_t free_objects;
+  size_t largest_free;
+  int num_chunks;
+
+  // Share of the heap not free
+
+  double utilization;
+};
+
+struct mymalloc_heap_info {
+  int num_arenas;
+  size_t heap_size;
+  size_t free_bytes;
+  size_t free_objects;
+  size_t largest_free;
+
+  // External fragmentation: the share of the free bytes outside the
+  // largest free object, which no single request can use together
+
+  double fragmentation;
+  double utilization;
+
+  // Total size of the slabs of the pools, which are outside the arenas
+
+  size_t pool_size;
+  unsigned long long free_size_histogram[MYMALLOC_HEAP_BUCKETS];
+  struct mymalloc_arena_info arenas[MYMALLOC_MAX_ARENAS];
+};
+
+void mymalloc_heap_info(struct mymalloc_heap_info *info);
+
+// Formats of the occupancy map written by mymalloc_heap_map()
+
+enum mymalloc_map_format {
+  MYMALLOC_MAP_TEXT,
+  MYMALLOC_MAP_SVG
+};
+
+int mymalloc_heap_map(char *buffer, size_t size,
+                      enum mymalloc_map_format format);
+
+// With MALLOCTRACE set to a file name in the environment, every call is
+// logged to that file: a struct mymalloc_trace_header, then one struct
+// mymalloc_trace_record per call, in the byte order of the machine. Records
+// of different threads are not in timestamp order. See tracetool.c.
+
+#define MYMALLOC_TRACE_MAGIC "MYMTRACE"
+#define MYMALLOC_TRACE_VERSION (1)
+
+enum mymalloc_trace_op {
+  MYMALLOC_TRACE_MALLOC,
+  MYMALLOC_TRACE_FREE,
+  MYMALLOC_TRACE_REALLOC,
+  MYMALLOC_TRACE_CALLOC,
+  MYMALLOC_TRACE_MEMALIGN
+};
+
+struct mymalloc_trace_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;
+};
+
+struct mymalloc_trace_record {
+  // CLOCK_MONOTONIC time of the call in nanoseconds
+
+  uint64_t timestamp;
+
+  // Bytes requested (0 for free()), the pointer passed in (for free() and
+  // realloc()) or the alignment (for memalign() and the like), the pointer
+  // returned, and the return address of the call
+
+  uint64_t size;
+  uint64_t ptr;
+  uint64_t result;
+  uint64_t caller;
+
+  // Kernel thread id of the caller, and the enum mymalloc_trace_op
+
+  uint32_t thread;
+  uint32_t op;
+};
 
 void print_list();
 
@@ -0,0 +1,165 @@
+//
+// CS252: MyMalloc Project
+//
+// Optional C++ shim: replaces the global operator new and operator delete
+// with MyMalloc, so that the sized operator delete C++14 compilers emit
+// reaches free_sized(). Link it in with MyMalloc.c, or build MyMalloc++.so
+// to preload both (see the Makefile).
+//
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+extern "C" {
+void free_sized(void *ptr, size_t size);
+void free_aligned_sized(void *ptr, size_t alignment, size_t size);
+}
+
+/*
+ * Allocate size bytes like malloc(), calling the new handler until it
+ * succeeds. Return NULL if there is no handler, or throw std::bad_alloc if
+ * nothrow is false.
+ */
+
+static void *allocate(std::size_t size, bool nothrow) {
+  if (size == 0) {
+    size = 1;
+  }
+
+  for (;;) {
+    void *ptr = malloc(size);
+    if (ptr != NULL) {
+      return ptr;
+    }
+
+    std::new_handler handler = std::get_new_handler();
+    if (handler == NULL) {
+      if (nothrow) {
+        return NULL;
+      }
+      throw std::bad_alloc();
+    }
+    handler();
+  }
+} /* allocate() */
+
+/*
+ * Allocate size bytes aligned to alignment like aligned_alloc(), calling
+ * the new handler until it succeeds. Return NULL if there is no handler, or
+ * throw std::bad_alloc if nothrow is false.
+ */
+
+static void *allocate_aligned(std::size_t size, std::align_val_t alignment,
+                              bool nothrow) {
+  if (size == 0) {
+    size = 1;
+  }
+
+  for (;;) {
+    void *ptr = NULL;
+    if (posix_memalign(&ptr, static_cast<std::size_t>(alignment), size) == 0) {
+      return ptr;
+    }
+
+    std::new_handler handler = std::get_new_handler();
+    if (handler == NULL) {
+      if (nothrow) {
+        return NULL;
+      }
+      throw std::bad_alloc();
+    }
+    handler();
+  }
+} /* allocate_aligned() */
+
+void *operator new(std::size_t size) {
+  return allocate(size, false);
+}
+
+void *operator new[](std::size_t size) {
+  return allocate(size, false);
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept {
+  return allocate(size, true);
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept {
+  return allocate(size, true);
+}
+
+void *operator new(std::size_t size, std::align_val_t alignment) {
+  return allocate_aligned(size, alignment, false);
+}
+
+void *operator new[](std::size_t size, std::align_val_t alignment) {
+  return allocate_aligned(size, alignment, false);
+}
+
+void *operator new(std::size_t size, std::align_val_t alignment,
+                   const std::nothrow_t &) noexcept {
+  return allocate_aligned(size, alignment, true);
+}
+
+void *operator new[](std::size_t size, std::align_val_t alignment,
+                     const std::nothrow_t &) noexcept {
+  return allocate_aligned(size, alignment, true);
+}
+
+void operator delete(void *ptr) noexcept {
+  free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept {
+  free(ptr);
+}
+
+void operator delete(void *ptr, const std::nothrow_t &) noexcept {
+  free(ptr);
+}
+
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept {
+  free(ptr);
+}
+
+// Sized deallocation: the size is the one passed to operator new, or 1 for
+// a zero-byte object
+
+void operator delete(void *ptr, std::size_t size) noexcept {
+  free_sized(ptr, (size == 0) ? 1 : size);
+}
+
+void operator delete[](void *ptr, std::size_t size) noexcept {
+  free_sized(ptr, (size == 0) ? 1 : size);
+}
+
+void operator delete(void *ptr, std::align_val_t) noexcept {
+  free(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t) noexcept {
+  free(ptr);
+}
+
+void operator delete(void *ptr, std::align_val_t,
+                     const std::nothrow_t &) noexcept {
+  free(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t,
+                       const std::nothrow_t &) noexcept {
+  free(ptr);
+}
+
+void operator delete(void *ptr, std::size_t size,
+                     std::align_val_t alignment) noexcept {
+  free_aligned_sized(ptr, static_cast<std::size_t>(alignment),
+                     (size == 0) ? 1 : size);
+}
+
+void operator delete[](void *ptr, std::size_t size,
+                       std::align_val_t alignment) noexcept {
+  free_aligned_sized(ptr, static_cast<std::size_t>(alignment),
+                     (size == 0) ? 1 : size);
+}
@@ -0,0 +1,603 @@
+//
+// CS252: MyMalloc Project
+//
+// Allocator benchmark, run against glibc and MyMalloc by runbench.
+//
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Allocator benchmark. It calls plain malloc(), free() and realloc(), so
+ * it measures glibc when run as is and MyMalloc when run with
+ * LD_PRELOAD=./MyMalloc.so (see runbench).
+ *
+ * Usage: bench [-t threads] [-n ops] [-s seed] [-l label] workload
+ *
+ * Workloads:
+ *   churn     replace random slots of a table of fixed-size objects
+ *   powerlaw  the same with sizes drawn from a power-law distribution
+ *   prodcons  half the threads allocate, the other half free
+ *   realloc   grow buffers with realloc() until they are large, then free
+ *   FILE      replay the trace in FILE
+ *
+ * A trace has one call per line, where ID names an object:
+ *   m ID SIZE   ID = malloc(SIZE)
+ *   c ID SIZE   ID = calloc(1, SIZE)
+ *   r ID SIZE   ID = realloc(ID, SIZE)
+ *   f ID        free(ID)
+ * Lines starting with # are ignored.
+ *
+ * Prints one line with throughput, the p50/p99/p999 latency of single
+ * calls, the peak RSS, and fragmentation, which is the growth of the RSS
+ * over the peak number of bytes the program had allocated.
+ */
+
+#define DEFAULT_OPS (2000000)
+#define DEFAULT_THREADS (4)
+#define DEFAULT_SEED (123456)
+
+#define CHURN_SLOTS (10000)
+#define CHURN_SIZE (64)
+
+#define POWERLAW_SLOTS (10000)
+#define POWERLAW_MIN (16)
+#define POWERLAW_MAX (1 << 20)
+#define POWERLAW_ALPHA (1.3)
+
+#define QUEUE_SIZE (1024)
+#define PRODCONS_MAX (512)
+
+#define REALLOC_SLOTS (64)
+#define REALLOC_MAX (1 << 20)
+
+// Latency histogram: exact below 64ns, then 32 buckets per power of two
+
+#define HIST_LINEAR (64)
+#define HIST_SUB_BITS (5)
+#define HIST_BUCKETS (HIST_LINEAR + (64 - 6) * (1 << HIST_SUB_BITS))
+
+struct histogram {
+  uint64_t count[HIST_BUCKETS];
+};
+
+// Per-thread state
+
+struct worker {
+  pthread_t thread;
+  int id;
+  uint64_t ops;
+  uint64_t rng;
+  struct histogram hist;
+  struct queue *queue;
+};
+
+// Single-producer single-consumer ring of pointers
+
+struct queue {
+  void *slot[QUEUE_SIZE];
+  size_t size[QUEUE_SIZE];
+  volatile uint64_t head;
+  volatile uint64_t tail;
+  volatile int done;
+};
+
+static uint64_t num_ops = DEFAULT_OPS;
+static int num_threads = DEFAULT_THREADS;
+static uint64_t seed = DEFAULT_SEED;
+
+// Bytes the program holds and the most it ever held
+
+static size_t live_bytes;
+static size_t peak_live_bytes;
+
+/*
+ * Return the time in nanoseconds.
+ */
+
+static inline uint64_t now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+} /* now() */
+
+/*
+ * Return the next number of a xorshift generator.
+ */
+
+static inline uint64_t next_random(uint64_t *state) {
+  uint64_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  *state = x;
+  return x;
+} /* next_random() */
+
+/*
+ * Record a call that took ns nanoseconds.
+ */
+
+static inline void record(struct histogram *hist, uint64_t ns) {
+  int bucket;
+  if (ns < HIST_LINEAR) {
+    bucket = (int) ns;
+  }
+  else {
+    int exponent = 63 - __builtin_clzll(ns);
+    int sub = (int) (ns >> (exponent - HIST_SUB_BITS)) &
+              ((1 << HIST_SUB_BITS) - 1);
+    bucket = HIST_LINEAR + ((exponent - 6) << HIST_SUB_BITS) + sub;
+  }
+  hist->count[bucket]++;
+} /* record() */
+
+/*
+ * Return the smallest latency in the bucket.
+ */
+
+static uint64_t bucket_value(int bucket) {
+  if (bucket < HIST_LINEAR) {
+    return (uint64_t) bucket;
+  }
+  int exponent = ((bucket - HIST_LINEAR) >> HIST_SUB_BITS) + 6;
+  uint64_t sub = (uint64_t) ((bucket - HIST_LINEAR) &
+                             ((1 << HIST_SUB_BITS) - 1));
+  return ((uint64_t) 1 << exponent) + (sub << (exponent - HIST_SUB_BITS));
+} /* bucket_value() */
+
+/*
+ * Return the latency below which the fraction q of the calls fall.
+ */
+
+static uint64_t percentile(struct histogram *hist, double q) {
+  uint64_t total = 0;
+  for (int i = 0; i < HIST_BUCKETS; i++) {
+    total += hist->count[i];
+  }
+
+  uint64_t rank = (uint64_t) ceil(q * (double) total);
+  uint64_t seen = 0;
+  for (int i = 0; i < HIST_BUCKETS; i++) {
+    seen += hist->count[i];
+    if ((seen >= rank) && (seen > 0)) {
+      return bucket_value(i);
+    }
+  }
+  return 0;
+} /* percentile() */
+
+/*
+ * Account for size more bytes held by the program (size may be negative).
+ */
+
+static inline void add_live(ssize_t size) {
+  size_t live = __atomic_add_fetch(&live_bytes, (size_t) size,
+                                   __ATOMIC_RELAXED);
+  size_t peak = __atomic_load_n(&peak_live_bytes, __ATOMIC_RELAXED);
+  while ((live > peak) &&
+         !__atomic_compare_exchange_n(&peak_live_bytes, &peak, live, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+} /* add_live() */
+
+/*
+ * Timed wrappers. They touch the memory they get, as a program would.
+ */
+
+static inline void *timed_malloc(struct worker *w, size_t size) {
+  uint64_t start = now();
+  void *ptr = malloc(size);
+  record(&w->hist, now() - start);
+  w->ops++;
+  if (ptr == NULL) {
+    fprintf(stderr, "bench: malloc(%zu) failed\n", size);
+    exit(1);
+  }
+  memset(ptr, 0xa5, size < 64 ? size : 64);
+  add_live((ssize_t) size);
+  return ptr;
+} /* timed_malloc() */
+
+static inline void *timed_calloc(struct worker *w, size_t size) {
+  uint64_t start = now();
+  void *ptr = calloc(1, size);
+  record(&w->hist, now() - start);
+  w->ops++;
+  if ((ptr == NULL) && (size > 0)) {
+    fprintf(stderr, "bench: calloc(1, %zu) failed\n", size);
+    exit(1);
+  }
+  add_live((ssize_t) size);
+  return ptr;
+} /* timed_calloc() */
+
+static inline void *timed_realloc(struct worker *w, void *ptr,
+                                  size_t old_size, size_t size) {
+  uint64_t start = now();
+  void *new_ptr = realloc(ptr, size);
+  record(&w->hist, now() - start);
+  w->ops++;
+  if ((new_ptr == NULL) && (size > 0)) {
+    fprintf(stderr, "bench: realloc(%zu) failed\n", size);
+    exit(1);
+  }
+  if (size > old_size) {
+    memset((char *) new_ptr + old_size, 0xa5,
+           size - old_size < 64 ? size - old_size : 64);
+  }
+  add_live((ssize_t) size - (ssize_t) old_size);
+  return new_ptr;
+} /* timed_realloc() */
+
+static inline void timed_free(struct worker *w, void *ptr, size_t size) {
+  uint64_t start = now();
+  free(ptr);
+  record(&w->hist, now() - start);
+  w->ops++;
+  add_live(-(ssize_t) size);
+} /* timed_free() */
+
+/*
+ * Return a size drawn from a bounded Pareto distribution: mostly small
+ * objects with a long tail of large ones.
+ */
+
+static size_t powerlaw_size(uint64_t *rng) {
+  double u = (double) ((next_random(rng) >> 11) + 1) / 9007199254740992.0;
+  double size = POWERLAW_MIN / pow(u, 1.0 / POWERLAW_ALPHA);
+  return size > POWERLAW_MAX ? POWERLAW_MAX : (size_t) size;
+} /* powerlaw_size() */
+
+/*
+ * Replace random slots of a table with new objects, of a fixed size or of
+ * power-law sizes.
+ */
+
+static void run_table(struct worker *w, int powerlaw) {
+  int slots = powerlaw ? POWERLAW_SLOTS : CHURN_SLOTS;
+  void **ptrs = calloc(slots, sizeof(void *));
+  size_t *sizes = calloc(slots, sizeof(size_t));
+  uint64_t ops = num_ops / num_threads;
+
+  while (w->ops < ops) {
+    int i = (int) (next_random(&w->rng) % slots);
+    if (ptrs[i] != NULL) {
+      timed_free(w, ptrs[i], sizes[i]);
+    }
+    sizes[i] = powerlaw ? powerlaw_size(&w->rng) : CHURN_SIZE;
+    ptrs[i] = timed_malloc(w, sizes[i]);
+  }
+
+  for (int i = 0; i < slots; i++) {
+    if (ptrs[i] != NULL) {
+      timed_free(w, ptrs[i], sizes[i]);
+    }
+  }
+  free(ptrs);
+  free(sizes);
+} /* run_table() */
+
+/*
+ * Even workers allocate objects and pass them to the next odd worker,
+ * which frees them.
+ */
+
+static void run_prodcons(struct worker *w) {
+  struct queue *queue = w->queue;
+  uint64_t ops = num_ops / num_threads;
+
+  if (w->id % 2 == 0) {
+    for (uint64_t i = 0; i < ops; i++) {
+      while (queue->tail - queue->head == QUEUE_SIZE) {
+        sched_yield();
+      }
+      size_t size = 1 + next_random(&w->rng) % PRODCONS_MAX;
+      uint64_t tail = queue->tail;
+      queue->size[tail % QUEUE_SIZE] = size;
+      queue->slot[tail % QUEUE_SIZE] = timed_malloc(w, size);
+      __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&queue->done, 1, __ATOMIC_RELEASE);
+    return;
+  }
+
+  for (;;) {
+    uint64_t head = queue->head;
+    if (head == __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE)) {
+      if (__atomic_load_n(&queue->done, __ATOMIC_ACQUIRE) &&
+          (head == __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE))) {
+        return;
+      }
+      sched_yield();
+      continue;
+    }
+    timed_free(w, queue->slot[head % QUEUE_SIZE],
+               queue->size[head % QUEUE_SIZE]);
+    __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+  }
+} /* run_prodcons() */
+
+/*
+ * Grow buffers by half of their size until they reach REALLOC_MAX, then
+ * free them and start over.
+ */
+
+static void run_realloc(struct worker *w) {
+  void *ptrs[REALLOC_SLOTS] = { NULL };
+  size_t sizes[REALLOC_SLOTS] = { 0 };
+  uint64_t ops = num_ops / num_threads;
+
+  while (w->ops < ops) {
+    int i = (int) (next_random(&w->rng) % REALLOC_SLOTS);
+    if (sizes[i] >= REALLOC_MAX) {
+      timed_free(w, ptrs[i], sizes[i]);
+      ptrs[i] = NULL;
+      sizes[i] = 0;
+      continue;
+    }
+    size_t size = sizes[i] + sizes[i] / 2 + 1 + next_random(&w->rng) % 16;
+    ptrs[i] = timed_realloc(w, ptrs[i], sizes[i], size);
+    sizes[i] = size;
+  }
+
+  for (int i = 0; i < REALLOC_SLOTS; i++) {
+    if (ptrs[i] != NULL) {
+      timed_free(w, ptrs[i], sizes[i]);
+    }
+  }
+} /* run_realloc() */
+
+// A call of a trace
+
+struct trace_op {
+  char op;
+  size_t id;
+  size_t size;
+};
+
+/*
+ * Read the trace in path. Return the number of calls, or -1 on error.
+ */
+
+static ssize_t read_trace(const char *path, struct trace_op **ops_out,
+                          size_t *num_ids) {
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    fprintf(stderr, "bench: %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  size_t capacity = 1024;
+  size_t count = 0;
+  struct trace_op *ops = malloc(capacity * sizeof(struct trace_op));
+  char line[256];
+  int line_number = 0;
+
+  *num_ids = 0;
+  while (fgets(line, sizeof(line), file) != NULL) {
+    line_number++;
+    if ((line[0] == '#') || (line[0] == '\n')) {
+      continue;
+    }
+
+    struct trace_op op = { 0, 0, 0 };
+    int fields = sscanf(line, " %c %zu %zu", &op.op, &op.id, &op.size);
+    if ((fields < 2) || ((op.op != 'f') && (fields < 3)) ||
+        (strchr("mcrf", op.op) == NULL)) {
+      fprintf(stderr, "bench: %s:%d: bad line\n", path, line_number);
+      fclose(file);
+      free(ops);
+      return -1;
+    }
+
+    if (count == capacity) {
+      capacity *= 2;
+      ops = realloc(ops, capacity * sizeof(struct trace_op));
+    }
+    ops[count++] = op;
+    if (op.id >= *num_ids) {
+      *num_ids = op.id + 1;
+    }
+  }
+
+  fclose(file);
+  *ops_out = ops;
+  return (ssize_t) count;
+} /* read_trace() */
+
+/*
+ * Replay a trace, read beforehand so that parsing is not measured.
+ * Calls on unknown objects are skipped.
+ */
+
+static void run_trace(struct worker *w, struct trace_op *ops, size_t count,
+                      size_t num_ids) {
+  void **ptrs = calloc(num_ids, sizeof(void *));
+  size_t *sizes = calloc(num_ids, sizeof(size_t));
+
+  for (size_t i = 0; i < count; i++) {
+    struct trace_op *op = &ops[i];
+    switch (op->op) {
+      case 'm':
+      case 'c':
+        if (ptrs[op->id] != NULL) {
+          timed_free(w, ptrs[op->id], sizes[op->id]);
+        }
+        ptrs[op->id] = (op->op == 'm') ? timed_malloc(w, op->size) :
+                                         timed_calloc(w, op->size);
+        sizes[op->id] = op->size;
+        break;
+      case 'r':
+        ptrs[op->id] = timed_realloc(w, ptrs[op->id], sizes[op->id],
+                                     op->size);
+        sizes[op->id] = op->size;
+        break;
+      case 'f':
+        if (ptrs[op->id] != NULL) {
+          timed_free(w, ptrs[op->id], sizes[op->id]);
+          ptrs[op->id] = NULL;
+        }
+        break;
+    }
+  }
+
+  for (size_t i = 0; i < num_ids; i++) {
+    if (ptrs[i] != NULL) {
+      timed_free(w, ptrs[i], sizes[i]);
+    }
+  }
+  free(ptrs);
+  free(sizes);
+} /* run_trace() */
+
+static const char *workload;
+
+/*
+ * Thread body.
+ */
+
+static void *run_worker(void *arg) {
+  struct worker *w = arg;
+
+  if (!strcmp(workload, "churn")) {
+    run_table(w, 0);
+  }
+  else if (!strcmp(workload, "powerlaw")) {
+    run_table(w, 1);
+  }
+  else if (!strcmp(workload, "prodcons")) {
+    run_prodcons(w);
+  }
+  else {
+    run_realloc(w);
+  }
+  return NULL;
+} /* run_worker() */
+
+/*
+ * Return the peak resident set size in bytes.
+ */
+
+static size_t peak_rss() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return (size_t) usage.ru_maxrss * 1024;
+} /* peak_rss() */
+
+/*
+ * Print usage and exit.
+ */
+
+static void usage() {
+  fprintf(stderr,
+          "usage: bench [-t threads] [-n ops] [-s seed] [-l label] "
+          "churn|powerlaw|prodcons|realloc|TRACE\n");
+  exit(2);
+} /* usage() */
+
+int main(int argc, char **argv) {
+  const char *label = "malloc";
+  int opt;
+
+  while ((opt = getopt(argc, argv, "t:n:s:l:")) != -1) {
+    switch (opt) {
+      case 't':
+        num_threads = atoi(optarg);
+        break;
+      case 'n':
+        num_ops = strtoull(optarg, NULL, 10);
+        break;
+      case 's':
+        seed = strtoull(optarg, NULL, 10);
+        break;
+      case 'l':
+        label = optarg;
+        break;
+      default:
+        usage();
+    }
+  }
+  if ((optind != argc - 1) || (num_threads < 1)) {
+    usage();
+  }
+  workload = argv[optind];
+
+  int is_trace = strcmp(workload, "churn") && strcmp(workload, "powerlaw") &&
+                 strcmp(workload, "prodcons") && strcmp(workload, "realloc");
+  struct trace_op *trace = NULL;
+  size_t num_ids = 0;
+  ssize_t trace_length = 0;
+
+  if (is_trace) {
+    trace_length = read_trace(workload, &trace, &num_ids);
+    if (trace_length < 0) {
+      return 1;
+    }
+    num_threads = 1;
+  }
+  else if (!strcmp(workload, "prodcons") && (num_threads % 2 != 0)) {
+    num_threads++;
+  }
+
+  struct worker *workers = calloc(num_threads, sizeof(struct worker));
+  struct queue *queues = calloc((num_threads + 1) / 2, sizeof(struct queue));
+  size_t start_rss = peak_rss();
+  uint64_t start = now();
+
+  if (is_trace) {
+    workers[0].rng = seed;
+    run_trace(&workers[0], trace, (size_t) trace_length, num_ids);
+  }
+  else {
+    for (int i = 0; i < num_threads; i++) {
+      workers[i].id = i;
+      workers[i].rng = seed + (uint64_t) i * 0x9e3779b97f4a7c15ULL;
+      workers[i].queue = &queues[i / 2];
+      pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]);
+    }
+    for (int i = 0; i < num_threads; i++) {
+      pthread_join(workers[i].thread, NULL);
+    }
+  }
+
+  double seconds = (double) (now() - start) / 1e9;
+
+  // Merge the results of the threads
+
+  struct histogram *hist = calloc(1, sizeof(struct histogram));
+  uint64_t ops = 0;
+  for (int i = 0; i < num_threads; i++) {
+    ops += workers[i].ops;
+    for (int j = 0; j < HIST_BUCKETS; j++) {
+      hist->count[j] += workers[i].hist.count[j];
+    }
+  }
+
+  size_t rss = peak_rss();
+  double fragmentation = peak_live_bytes ?
+    (double) (rss - start_rss) / (double) peak_live_bytes : 0.0;
+
+  printf("%-10s %-10s %12.0f ops/s  p50 %6lu ns  p99 %7lu ns  "
+         "p999 %8lu ns  rss %8zu KB  frag %5.2f\n",
+         is_trace ? "trace" : workload, label, (double) ops / seconds,
+         (unsigned long) percentile(hist, 0.5),
+         (unsigned long) percentile(hist, 0.99),
+         (unsigned long) percentile(hist, 0.999),
+         rss / 1024, fragmentation);
+
+  free(hist);
+  free(queues);
+  free(workers);
+  free(trace);
+  return 0;
+} /* main() */
@@ -0,0 +1,143 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "MyMalloc.h"
+
+#define ALLOCATIONS 4
+#define CHUNK_REQUEST 2000000
+#define SPAN 500000
+
+int failures = 0;
+
+/*
+ * Report a check that does not hold
+ */
+
+void check(int holds, const char *what) {
+  if (!holds) {
+    printf("FAIL: %s\n", what);
+    failures++;
+  }
+} /* check() */
+
+/*
+ * Return the number of whole pages inside the size bytes at address that
+ * are resident in memory
+ */
+
+size_t resident_pages(size_t address, size_t size) {
+  size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+  char *start = (char *) ((address + page_size - 1) & ~(page_size - 1));
+  char *end = (char *) ((address + size) & ~(page_size - 1));
+  unsigned char pages[SPAN / 4096 + 1];
+  size_t resident = 0;
+
+  if ((end <= start) ||
+      (mincore(start, (size_t) (end - start), pages) != 0)) {
+    return 0;
+  }
+  for (size_t i = 0; i < (size_t) (end - start) / page_size; i++) {
+    resident += pages[i] & 1;
+  }
+  return resident;
+} /* resident_pages() */
+
+/*
+ * Fill several OS chunks, free them, and check that malloc_trim() gives
+ * them back and the chunk count and statistics follow. Then check that
+ * trimming gives back the pages inside a free object that cannot be
+ * released whole, including the pages it gains by coalescing after an
+ * earlier trim
+ */
+
+int main(int argc, char **argv) {
+  struct mymalloc_heap_info info;
+  struct mymalloc_stats stats;
+  char *ptrs[ALLOCATIONS];
+
+  printf("\n---- Running test9-1 ---\n");
+
+  int i;
+  for (i = 0; i < ALLOCATIONS; i++) {
+    ptrs[i] = (char *) malloc(CHUNK_REQUEST);
+    memset(ptrs[i], 1, CHUNK_REQUEST);
+  }
+  mymalloc_heap_info(&info);
+  check(info.arenas[0].num_chunks == ALLOCATIONS,
+        "one chunk per allocation");
+  check(info.heap_size >= ALLOCATIONS * (size_t) CHUNK_REQUEST,
+        "heap holds the allocations");
+  size_t heap_size = info.heap_size;
+
+  mymalloc_stats(&stats);
+  unsigned long long releases = stats.os_chunk_releases;
+
+  for (i = 0; i < ALLOCATIONS; i++) {
+    free(ptrs[i]);
+  }
+  check(malloc_trim(0) == 1, "malloc_trim() releases the chunks");
+  mymalloc_heap_info(&info);
+  check(info.arenas[0].num_chunks == 0, "no chunk left after trimming");
+  check(info.heap_size == 0, "empty heap after trimming");
+
+  mymalloc_stats(&stats);
+  check(stats.os_chunk_releases == releases + ALLOCATIONS,
+        "every chunk counted as released");
+  check(stats.heap_size == 0, "statistics show an empty heap");
+  check(stats.live_bytes == 0, "no live bytes after freeing everything");
+
+  // The chunks come back
+
+  for (i = 0; i < ALLOCATIONS; i++) {
+    ptrs[i] = (char *) malloc(CHUNK_REQUEST);
+    memset(ptrs[i], 1, CHUNK_REQUEST);
+  }
+  mymalloc_heap_info(&info);
+  check(info.arenas[0].num_chunks == ALLOCATIONS, "chunks come back");
+  check(info.heap_size == heap_size, "heap grows back to the same size");
+  for (i = 0; i < ALLOCATIONS; i++) {
+    free(ptrs[i]);
+  }
+  malloc_trim(0);
+
+  // Two spans between allocated guards, so that their chunk stays
+
+  char *guard1 = (char *) malloc(16);
+  char *first = (char *) malloc(SPAN);
+  char *second = (char *) malloc(SPAN);
+  char *guard2 = (char *) malloc(16);
+  memset(first, 1, SPAN);
+  memset(second, 1, SPAN);
+  size_t first_address = (size_t) first;
+  size_t second_address = (size_t) second;
+
+  free(first);
+  check(malloc_trim(0) == 1, "malloc_trim() gives back a free span");
+  check(resident_pages(first_address, SPAN) == 0, "free span not resident");
+
+  // The second span coalesces with the trimmed first one
+
+  free(second);
+  malloc_trim(0);
+  check(resident_pages(second_address, SPAN) == 0,
+        "span coalesced after trimming not resident");
+
+  // Pages given back read as zero when the memory is reused
+
+  char *fresh = (char *) malloc(2 * SPAN);
+  check((size_t) fresh == first_address, "coalesced spans reused");
+  size_t nonzero = 0;
+  for (i = 4096; i < 2 * SPAN - 4096; i++) {
+    nonzero += (fresh[i] != 0);
+  }
+  check(nonzero == 0, "trimmed pages read as zero");
+  free(fresh);
+  free(guard1);
+  free(guard2);
+
+  printf(failures ? "FAIL\n" : "PASS\n");
+  exit(failures ? 1 : 0);
+} /* main() */
@@ -0,0 +1,204 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "MyMalloc.h"
+
+#define ALLOCATIONS 6
+#define HOLES 8
+#define HOLE_SIZE 1000
+#define CELL_SIZE 4096
+
+int failures = 0;
+
+/*
+ * Report a check that does not hold
+ */
+
+void check(int holds, const char *what) {
+  if (!holds) {
+    printf("FAIL: %s\n", what);
+    failures++;
+  }
+} /* check() */
+
+/*
+ * Return whether x and y are equal but for rounding
+ */
+
+int close_to(double x, double y) {
+  return (x - y < 1e-9) && (y - x < 1e-9);
+} /* close_to() */
+
+/*
+ * Check that the figures of info agree with each other
+ */
+
+void check_info(struct mymalloc_heap_info *info) {
+  unsigned long long histogram_objects = 0;
+  for (int i = 0; i < MYMALLOC_HEAP_BUCKETS; i++) {
+    histogram_objects += info->free_size_histogram[i];
+  }
+
+  check(info->num_arenas == 1, "one arena");
+  check(info->free_bytes <= info->heap_size, "free bytes inside the heap");
+  check(info->largest_free <= info->free_bytes,
+        "largest free object inside the free bytes");
+  check(histogram_objects == info->free_objects,
+        "histogram counts every free object");
+  check(close_to(info->fragmentation, (info->free_bytes == 0) ? 0.0 :
+                 1.0 - (double) info->largest_free /
+                       (double) info->free_bytes),
+        "fragmentation is the share of free bytes outside the largest");
+  check(close_to(info->utilization, (info->heap_size == 0) ? 0.0 :
+                 1.0 - (double) info->free_bytes / (double) info->heap_size),
+        "utilization is the share of the heap not free");
+  check((info->arenas[0].heap_size == info->heap_size) &&
+        (info->arenas[0].free_bytes == info->free_bytes) &&
+        (info->arenas[0].free_objects == info->free_objects) &&
+        (info->arenas[0].largest_free == info->largest_free) &&
+        close_to(info->arenas[0].utilization, info->utilization),
+        "the only arena holds the whole heap");
+} /* check_info() */
+
+/*
+ * Check that the heap map shows num_chunks chunks, with one cell per
+ * CELL_SIZE bytes of each, and that it agrees with mymalloc_heap_info()
+ */
+
+void check_map(int num_chunks) {
+  static char map[1 << 20];
+  static char short_map[16];
+  struct mymalloc_heap_info info;
+  int map_chunks = 0;
+  size_t heap_size = 0;
+  size_t cells = 0;
+  size_t expected_cells = 0;
+  size_t used_cells = 0;
+  size_t full_cells = 0;
+
+  mymalloc_heap_info(&info);
+  check_info(&info);
+
+  int length = mymalloc_heap_map(map, sizeof(map), MYMALLOC_MAP_TEXT);
+  check((length > 0) && (length < (int) sizeof(map)), "map fits");
+  if ((length <= 0) || (length >= (int) sizeof(map))) {
+    return;
+  }
+  check(mymalloc_heap_map(short_map, sizeof(short_map),
+                          MYMALLOC_MAP_TEXT) == length,
+        "truncated map gives the whole length");
+
+  // The first line is the legend
+
+  char *line = strchr(map, '\n');
+  while ((line != NULL) && (*++line != '\0')) {
+    int arena;
+    void *start;
+    size_t size;
+
+    if (sscanf(line, "arena %d chunk %p, %zu bytes", &arena, &start,
+               &size) == 3) {
+      map_chunks++;
+      heap_size += size;
+      expected_cells += (size + CELL_SIZE - 1) / CELL_SIZE;
+    }
+    else {
+      for (char *cell = line; (*cell != '\n') && (*cell != '\0'); cell++) {
+        cells++;
+        used_cells += (*cell != '.');
+        full_cells += (*cell == '#');
+      }
+    }
+    line = strchr(line, '\n');
+  }
+
+  size_t used_bytes = info.heap_size - info.free_bytes;
+
+  check(map_chunks == num_chunks, "map shows every chunk");
+  check(info.arenas[0].num_chunks == num_chunks, "heap info counts chunks");
+  check(heap_size == info.heap_size, "map covers the heap");
+  check(cells == expected_cells, "one cell per page of each chunk");
+  check((full_cells <= used_bytes / CELL_SIZE + num_chunks) &&
+        (used_cells * CELL_SIZE >= used_bytes),
+        "map cells agree with the bytes in use");
+} /* check_map() */
+
+/*
+ * Fill several OS chunks of two sizes, punch holes in one, free some of
+ * them, trim, and check the heap figures and map at each step
+ */
+
+int main(int argc, char **argv) {
+  struct mymalloc_heap_info before;
+  struct mymalloc_heap_info after;
+  char *ptrs[ALLOCATIONS];
+  char *holes[HOLES];
+
+  printf("\n---- Running test9-2 ---\n");
+
+  // The small requests share a chunk, the large ones get one each
+
+  int i;
+  for (i = 0; i < ALLOCATIONS; i++) {
+    ptrs[i] = (char *) malloc((i % 2) ? 2000000 : 500000);
+    *ptrs[i] = 1;
+  }
+  check_map(4);
+
+  // Free every other block of a run, between blocks still in use
+
+  for (i = 0; i < HOLES; i++) {
+    holes[i] = (char *) malloc(HOLE_SIZE);
+  }
+  mymalloc_heap_info(&before);
+  for (i = 1; i < HOLES - 1; i += 2) {
+    free(holes[i]);
+  }
+  mymalloc_heap_info(&after);
+
+  size_t freed = after.free_bytes - before.free_bytes;
+  size_t hole = freed / (HOLES / 2 - 1);
+  int bucket = 0;
+  while ((hole >> (bucket + 1)) != 0) {
+    bucket++;
+  }
+
+  check(after.free_objects == before.free_objects + HOLES / 2 - 1,
+        "every hole a free object");
+  check((hole >= HOLE_SIZE) && (hole < 2 * HOLE_SIZE) &&
+        (freed == hole * (HOLES / 2 - 1)), "holes of the freed size");
+  check(after.largest_free == before.largest_free,
+        "holes leave the largest free object");
+  check(after.free_size_histogram[bucket] ==
+        before.free_size_histogram[bucket] + HOLES / 2 - 1,
+        "holes counted in their histogram bucket");
+  check(after.fragmentation > before.fragmentation,
+        "holes add to the fragmentation");
+  check(after.utilization < before.utilization,
+        "holes take from the utilization");
+  check_map(4);
+
+  for (i = 0; i < HOLES; i += 2) {
+    free(holes[i]);
+  }
+  free(holes[HOLES - 1]);
+
+  // Free a chunk in the middle, which stays, and the last one, which goes
+
+  free(ptrs[1]);
+  free(ptrs[ALLOCATIONS - 1]);
+  malloc_trim(0);
+  check_map(3);
+
+  for (i = 0; i < ALLOCATIONS - 1; i++) {
+    if (i != 1) {
+      free(ptrs[i]);
+    }
+  }
+  malloc_trim(0);
+  check_map(0);
+
+  printf(failures ? "FAIL\n" : "PASS\n");
+  exit(failures ? 1 : 0);
+} /* main() */
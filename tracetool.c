@@ -0,0 +1,430 @@
+//
+// CS252: MyMalloc Project
+//
+// Trace tool for the traces MyMalloc writes with MALLOCTRACE.
+//
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "MyMalloc.h"
+
+/*
+ * Reads a trace written by MyMalloc.so with MALLOCTRACE=FILE (see
+ * MyMalloc.h), and prints it in one of three forms.
+ *
+ * Usage: tracetool sizes|lifetimes|replay TRACE
+ *
+ *   sizes      histogram of the requested sizes, per call
+ *   lifetimes  histogram of the time from allocation to free(), and the
+ *              number of objects never freed
+ *   replay     the calls as a trace bench can replay, with object IDs
+ *              reused once freed, e.g.
+ *                tracetool replay app.trace > app.txt; ./runbench app.txt
+ *
+ * The records of all threads are merged in timestamp order. Calls on
+ * pointers the trace never returned, such as objects allocated before
+ * tracing started, are skipped, as are failed allocations.
+ */
+
+// Histograms have one bucket per power of two: bucket k counts values in
+// [2**(k-1), 2**k), and bucket 0 counts zeros.
+
+#define BUCKETS (65)
+
+// A record, with its position in the file to keep the order of records
+// with equal timestamps
+
+struct event {
+  struct mymalloc_trace_record record;
+  size_t order;
+};
+
+// A live object: its address, ID, and allocation time. A slot is empty if
+// address is 0.
+
+struct object {
+  uint64_t address;
+  size_t id;
+  uint64_t allocated_at;
+};
+
+// Live objects by address, in an open-addressing hash table
+
+static struct object *objects;
+static size_t capacity;
+static size_t num_objects;
+
+// IDs of freed objects, to hand out again, and the next new ID
+
+static size_t *free_ids;
+static size_t num_free_ids;
+static size_t next_id;
+
+/*
+ * Return the bucket of value.
+ */
+
+static inline int bucket_of(uint64_t value) {
+  return (value == 0) ? 0 : 64 - __builtin_clzll(value);
+} /* bucket_of() */
+
+/*
+ * Return the smallest value in bucket.
+ */
+
+static inline uint64_t bucket_start(int bucket) {
+  return (bucket == 0) ? 0 : (uint64_t) 1 << (bucket - 1);
+} /* bucket_start() */
+
+/*
+ * Order events by timestamp, then by position in the file.
+ */
+
+static int compare_events(const void *a, const void *b) {
+  const struct event *x = a;
+  const struct event *y = b;
+
+  if (x->record.timestamp != y->record.timestamp) {
+    return (x->record.timestamp < y->record.timestamp) ? -1 : 1;
+  }
+  return (x->order < y->order) ? -1 : (x->order > y->order);
+} /* compare_events() */
+
+/*
+ * Read the trace in path, sorted by timestamp. Return the number of
+ * records, or -1 on error.
+ */
+
+static ssize_t read_trace(const char *path, struct event **events_out) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    fprintf(stderr, "tracetool: %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  struct mymalloc_trace_header header;
+  if ((fread(&header, sizeof(header), 1, file) != 1) ||
+      memcmp(header.magic, MYMALLOC_TRACE_MAGIC, sizeof(header.magic)) ||
+      (header.version != MYMALLOC_TRACE_VERSION) ||
+      (header.record_size != sizeof(struct mymalloc_trace_record))) {
+    fprintf(stderr, "tracetool: %s: not a MyMalloc trace\n", path);
+    fclose(file);
+    return -1;
+  }
+
+  size_t capacity = 1024;
+  size_t count = 0;
+  struct event *events = malloc(capacity * sizeof(struct event));
+
+  for (;;) {
+    if (count == capacity) {
+      capacity *= 2;
+      events = realloc(events, capacity * sizeof(struct event));
+    }
+    if (fread(&events[count].record, sizeof(struct mymalloc_trace_record), 1,
+              file) != 1) {
+      break;
+    }
+    events[count].order = count;
+    count++;
+  }
+
+  fclose(file);
+  qsort(events, count, sizeof(struct event), compare_events);
+  *events_out = events;
+  return (ssize_t) count;
+} /* read_trace() */
+
+/*
+ * Return the slot of the live object at address, or the empty slot where
+ * it would go.
+ */
+
+static struct object *find_object(uint64_t address) {
+  size_t index = (size_t) ((address >> 4) * 0x9e3779b97f4a7c15ULL) &
+                 (capacity - 1);
+  while ((objects[index].address != 0) &&
+         (objects[index].address != address)) {
+    index = (index + 1) & (capacity - 1);
+  }
+  return &objects[index];
+} /* find_object() */
+
+/*
+ * Add a live object at address, allocated at time, with the given ID.
+ */
+
+static void add_object(uint64_t address, size_t id, uint64_t time) {
+  if (2 * (num_objects + 1) > capacity) {
+    // Grow the table, keeping it at most half full
+
+    struct object *old_objects = objects;
+    size_t old_capacity = capacity;
+    capacity *= 2;
+    objects = calloc(capacity, sizeof(struct object));
+    for (size_t i = 0; i < old_capacity; i++) {
+      if (old_objects[i].address != 0) {
+        *find_object(old_objects[i].address) = old_objects[i];
+      }
+    }
+    free(old_objects);
+  }
+
+  struct object *slot = find_object(address);
+  slot->address = address;
+  slot->id = id;
+  slot->allocated_at = time;
+  num_objects++;
+} /* add_object() */
+
+/*
+ * Remove the live object in slot, shifting back the objects after it that
+ * would otherwise become unreachable.
+ */
+
+static void remove_object(struct object *slot) {
+  size_t hole = (size_t) (slot - objects);
+  size_t index = hole;
+
+  for (;;) {
+    index = (index + 1) & (capacity - 1);
+    if (objects[index].address == 0) {
+      break;
+    }
+
+    size_t home = (size_t) ((objects[index].address >> 4) *
+                            0x9e3779b97f4a7c15ULL) & (capacity - 1);
+    if (((index - home) & (capacity - 1)) >=
+        ((index - hole) & (capacity - 1))) {
+      objects[hole] = objects[index];
+      hole = index;
+    }
+  }
+
+  objects[hole].address = 0;
+  num_objects--;
+} /* remove_object() */
+
+/*
+ * Return an ID for a new object, reusing the ID of a freed one if any.
+ */
+
+static size_t take_id() {
+  return (num_free_ids > 0) ? free_ids[--num_free_ids] : next_id++;
+} /* take_id() */
+
+/*
+ * Give the ID of a freed object back.
+ */
+
+static void release_id(size_t id) {
+  free_ids[num_free_ids++] = id;
+} /* release_id() */
+
+/*
+ * Follow the objects through the trace, printing it as a bench trace if
+ * replay is set, and counting their lifetimes in nanoseconds in lifetimes.
+ * Return the number of objects never freed.
+ */
+
+static size_t follow_objects(struct event *events, size_t count, int replay,
+                             uint64_t *lifetimes) {
+  // There are never more freed IDs than allocations
+
+  free_ids = malloc((count + 1) * sizeof(size_t));
+  capacity = 1024;
+  objects = calloc(capacity, sizeof(struct object));
+
+  for (size_t i = 0; i < count; i++) {
+    struct mymalloc_trace_record *record = &events[i].record;
+    struct object *slot = NULL;
+
+    if ((record->op == MYMALLOC_TRACE_FREE) ||
+        (record->op == MYMALLOC_TRACE_REALLOC)) {
+      if (record->ptr != 0) {
+        slot = find_object(record->ptr);
+        if (slot->address == 0) {
+          slot = NULL;
+        }
+      }
+      if ((record->op == MYMALLOC_TRACE_FREE) || (record->result == 0)) {
+        // A failed realloc() leaves the object alone
+
+        if ((record->op == MYMALLOC_TRACE_FREE) && (slot != NULL)) {
+          if (replay) {
+            printf("f %zu\n", slot->id);
+          }
+          lifetimes[bucket_of(record->timestamp - slot->allocated_at)]++;
+          release_id(slot->id);
+          remove_object(slot);
+        }
+        continue;
+      }
+    }
+    else if (record->result == 0) {
+      continue;
+    }
+
+    // The object at result is new, or moved there by realloc()
+
+    size_t id;
+    uint64_t allocated_at = record->timestamp;
+    char op = (record->op == MYMALLOC_TRACE_CALLOC) ? 'c' : 'm';
+    if (slot != NULL) {
+      id = slot->id;
+      allocated_at = slot->allocated_at;
+      op = 'r';
+      remove_object(slot);
+    }
+    else {
+      id = take_id();
+    }
+
+    struct object *stale = find_object(record->result);
+    if (stale->address != 0) {
+      // The free() of the previous object there was recorded late, by a
+      // thread that raced with this one, so forget it
+
+      if (replay) {
+        printf("f %zu\n", stale->id);
+      }
+      release_id(stale->id);
+      remove_object(stale);
+    }
+
+    if (replay) {
+      printf("%c %zu %llu\n", op, id, (unsigned long long) record->size);
+    }
+    add_object(record->result, id, allocated_at);
+  }
+
+  return num_objects;
+} /* follow_objects() */
+
+/*
+ * Print the number of calls of each kind, and the histogram of the sizes
+ * they requested.
+ */
+
+static void print_sizes(struct event *events, size_t count) {
+  static const char *names[] = {
+    "malloc", "free", "realloc", "calloc", "memalign"
+  };
+  enum { NUM_OPS = sizeof(names) / sizeof(names[0]) };
+  uint64_t hist[NUM_OPS][BUCKETS];
+  uint64_t calls[NUM_OPS];
+  memset(hist, 0, sizeof(hist));
+  memset(calls, 0, sizeof(calls));
+
+  for (size_t i = 0; i < count; i++) {
+    struct mymalloc_trace_record *record = &events[i].record;
+    if (record->op < NUM_OPS) {
+      calls[record->op]++;
+      if (record->op != MYMALLOC_TRACE_FREE) {
+        hist[record->op][bucket_of(record->size)]++;
+      }
+    }
+  }
+
+  printf("%-10s", "");
+  for (int op = 0; op < NUM_OPS; op++) {
+    printf(" %12s", names[op]);
+  }
+  printf("\n%-10s", "calls");
+  for (int op = 0; op < NUM_OPS; op++) {
+    printf(" %12llu", (unsigned long long) calls[op]);
+  }
+  printf("\n\n%-10s\n", "size >=");
+
+  for (int bucket = 0; bucket < BUCKETS; bucket++) {
+    uint64_t total = 0;
+    for (int op = 0; op < NUM_OPS; op++) {
+      total += hist[op][bucket];
+    }
+    if (total == 0) {
+      continue;
+    }
+
+    printf("%-10llu", (unsigned long long) bucket_start(bucket));
+    for (int op = 0; op < NUM_OPS; op++) {
+      printf(" %12llu", (unsigned long long) hist[op][bucket]);
+    }
+    printf("\n");
+  }
+} /* print_sizes() */
+
+/*
+ * Print the histogram of object lifetimes, with the cumulative share of
+ * freed objects, and the number of objects never freed.
+ */
+
+static void print_lifetimes(struct event *events, size_t count) {
+  uint64_t lifetimes[BUCKETS];
+  memset(lifetimes, 0, sizeof(lifetimes));
+  size_t leaked = follow_objects(events, count, 0, lifetimes);
+
+  uint64_t freed = 0;
+  for (int bucket = 0; bucket < BUCKETS; bucket++) {
+    freed += lifetimes[bucket];
+  }
+
+  printf("%-14s %12s %8s\n", "lifetime ns >=", "objects", "cumul %");
+  uint64_t so_far = 0;
+  for (int bucket = 0; bucket < BUCKETS; bucket++) {
+    if (lifetimes[bucket] == 0) {
+      continue;
+    }
+    so_far += lifetimes[bucket];
+    printf("%-14llu %12llu %8.2f\n",
+           (unsigned long long) bucket_start(bucket),
+           (unsigned long long) lifetimes[bucket],
+           100.0 * (double) so_far / (double) freed);
+  }
+  printf("never freed %zu\n", leaked);
+} /* print_lifetimes() */
+
+/*
+ * Print usage and exit.
+ */
+
+static void usage() {
+  fprintf(stderr, "usage: tracetool sizes|lifetimes|replay TRACE\n");
+  exit(2);
+} /* usage() */
+
+int main(int argc, char **argv) {
+  if (argc != 3) {
+    usage();
+  }
+
+  struct event *events = NULL;
+  ssize_t count = read_trace(argv[2], &events);
+  if (count < 0) {
+    return 1;
+  }
+
+  if (!strcmp(argv[1], "sizes")) {
+    print_sizes(events, (size_t) count);
+  }
+  else if (!strcmp(argv[1], "lifetimes")) {
+    print_lifetimes(events, (size_t) count);
+  }
+  else if (!strcmp(argv[1], "replay")) {
+    uint64_t lifetimes[BUCKETS];
+    memset(lifetimes, 0, sizeof(lifetimes));
+    printf("# replay of %s\n", argv[2]);
+    follow_objects(events, (size_t) count, 1, lifetimes);
+  }
+  else {
+    usage();
+  }
+
+  free(events);
+  free(objects);
+  free(free_ids);
+  return 0;
+} /* main() */